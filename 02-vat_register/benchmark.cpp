@@ -0,0 +1,361 @@
+/**
+ * @file benchmark.cpp
+ * @brief Workload benchmark for CVATRegister, reports throughput and latency percentiles per operation
+ *
+ * Build: g++ -std=c++17 -O2 -pthread benchmark.cpp -o benchmark
+ * Usage: ./benchmark [--save-baseline FILE] [--baseline FILE] [--threshold PERCENT] [companies count]...
+ *        (default scales 1000 10000 100000, default threshold 20 %)
+ *
+ * --save-baseline stores the median latency of every operation and phase throughput, --baseline compares
+ * the run with a stored baseline and exits with failure if anything got slower by more than the threshold.
+ */
+
+// The register brings all standard headers it needs, only its test main() is left out
+#define VAT_REGISTER_NO_MAIN
+#include "main.cpp"
+
+#include <random>
+
+/**
+ * @brief Zipf distributed ranks in [0, n), sampled in O(1) by inverting the continuous approximation of the CDF
+ */
+class CZipfGenerator
+{
+private:
+    double m_n;
+    double m_s;
+    uniform_real_distribution<double> m_uniform{0.0, 1.0};
+
+public:
+    CZipfGenerator(size_t n, double s)
+        : m_n((double)n), m_s(s){};
+
+    size_t operator()(mt19937_64 &rng)
+    {
+        double u = m_uniform(rng);
+        double rank;
+
+        if (fabs(m_s - 1.0) < 1e-9)
+            rank = pow(m_n + 1.0, u);
+        else
+            rank = pow((pow(m_n + 1.0, 1.0 - m_s) - 1.0) * u + 1.0, 1.0 / (1.0 - m_s));
+
+        return min((size_t)rank - 1, (size_t)m_n - 1);
+    }
+};
+
+enum EOperationType
+{
+    OP_NEW,
+    OP_INVOICE,
+    OP_AUDIT,
+    OP_CANCEL,
+    OP_MEDIAN,
+    OP_COUNT
+};
+
+static const char *OPERATION_NAMES[OP_COUNT] = {"newCompany", "invoice", "audit", "cancelCompany", "medianInvoice"};
+
+// Share of each operation in the mixed workload, in percents
+static const int OPERATION_WEIGHTS[OP_COUNT] = {5, 60, 20, 5, 10};
+
+// Measured value of one operation (or the whole phase) at one scale, the unit of comparison with the baseline
+struct TResult
+{
+    string m_name;
+    double m_value;
+    // Throughput regresses when it falls, latency when it grows
+    bool m_higherIsBetter;
+};
+
+struct TCompanyData
+{
+    string m_name;
+    string m_address;
+    string m_taxId;
+};
+
+/**
+ * @brief Randomly change case of letters, the register must treat names and addresses case-insensitively
+ */
+static string mixCase(const string &str, mt19937_64 &rng)
+{
+    string result = str;
+    for (char &c : result)
+        if (isalpha((unsigned char)c) && (rng() & 1))
+            c = (char)(isupper((unsigned char)c) ? tolower((unsigned char)c) : toupper((unsigned char)c));
+    return result;
+}
+
+static TCompanyData makeCompany(size_t index, mt19937_64 &rng)
+{
+    static const char *streets[] = {"Thakurova", "Kolejni", "Technicka", "Jugoslavskych partyzanu", "Zikova"};
+
+    return {mixCase("Company " + to_string(index * 2654435761u % 1000003u) + " s.r.o.", rng),
+            mixCase(string(streets[index % 5]) + " " + to_string(index % 997), rng),
+            "CZ" + to_string(10000000 + index)};
+}
+
+/**
+ * @brief Print throughput, latency percentiles and count of failed calls of every operation type
+ *
+ * Phase throughput and median latency of every operation are also appended to results.
+ */
+static void printResults(size_t scale, const char *phase, vector<uint64_t> (&latencies)[OP_COUNT], const size_t (&failures)[OP_COUNT],
+                         double seconds, vector<TResult> &results)
+{
+    size_t total = 0;
+    for (auto &latency : latencies)
+        total += latency.size();
+
+    cout << "  " << phase << ": " << total << " ops in " << fixed << setprecision(3) << seconds << " s, "
+         << setprecision(0) << (total / seconds) << " ops/s" << endl;
+
+    string prefix = to_string(scale) + "/" + phase + "/";
+    results.push_back({prefix + "ops_per_second", total / seconds, true});
+
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        vector<uint64_t> &values = latencies[op];
+        if (values.empty())
+            continue;
+
+        sort(values.begin(), values.end());
+        auto percentile = [&values](double p)
+        { return values[min((size_t)(p * values.size()), values.size() - 1)]; };
+
+        cout << "    " << left << setw(14) << OPERATION_NAMES[op] << right
+             << " count " << setw(9) << values.size()
+             << "  p50 " << setw(8) << percentile(0.5) << " ns"
+             << "  p99 " << setw(8) << percentile(0.99) << " ns"
+             << "  p999 " << setw(9) << percentile(0.999) << " ns"
+             << "  failed " << failures[op] << endl;
+
+        results.push_back({prefix + OPERATION_NAMES[op] + "/p50_ns", (double)percentile(0.5), false});
+    }
+}
+
+static void runScale(size_t companiesCount, uint64_t seed, vector<TResult> &results)
+{
+    mt19937_64 rng(seed);
+    CZipfGenerator zipf(companiesCount, 1.0);
+    uniform_int_distribution<int> opDistribution(0, 99);
+    uniform_int_distribution<unsigned int> amountDistribution(1, 1000000);
+
+    vector<TCompanyData> companies;
+    companies.reserve(companiesCount);
+    for (size_t i = 0; i < companiesCount; i++)
+        companies.push_back(makeCompany(i, rng));
+
+    // Shuffle the insertion order, so companies don't arrive sorted by taxId
+    vector<size_t> order(companiesCount);
+    for (size_t i = 0; i < companiesCount; i++)
+        order[i] = i;
+    shuffle(order.begin(), order.end(), rng);
+
+    CVATRegister reg;
+    vector<uint64_t> latencies[OP_COUNT];
+    size_t failures[OP_COUNT] = {};
+
+    cout << "companies: " << companiesCount << endl;
+
+    // Phase 1: fill the register
+    auto phaseStart = chrono::steady_clock::now();
+    for (size_t index : order)
+    {
+        const TCompanyData &company = companies[index];
+
+        auto start = chrono::steady_clock::now();
+        bool success = reg.newCompany(company.m_name, company.m_address, company.m_taxId);
+        auto end = chrono::steady_clock::now();
+
+        latencies[OP_NEW].push_back(chrono::duration_cast<chrono::nanoseconds>(end - start).count());
+        failures[OP_NEW] += !success;
+    }
+    printResults(companiesCount, "load", latencies, failures, chrono::duration<double>(chrono::steady_clock::now() - phaseStart).count(), results);
+
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        latencies[op].clear();
+        failures[op] = 0;
+    }
+
+    // Phase 2: mixed workload, popular companies (by Zipf rank) get most of the invoices and audits
+    size_t operationsCount = max((size_t)100000, companiesCount);
+    size_t nextIndex = companiesCount;
+    vector<size_t> cancelled;
+
+    phaseStart = chrono::steady_clock::now();
+    for (size_t i = 0; i < operationsCount; i++)
+    {
+        int roll = opDistribution(rng);
+        int op = 0;
+        while (roll >= OPERATION_WEIGHTS[op])
+            roll -= OPERATION_WEIGHTS[op++];
+
+        const TCompanyData &company = companies[zipf(rng) * 2654435761u % companiesCount];
+        chrono::steady_clock::time_point start, end;
+        bool success = true;
+
+        switch (op)
+        {
+        case OP_NEW:
+        {
+            // Re-register a cancelled company, so the population stays stable over a long run
+            TCompanyData created;
+            if (cancelled.empty())
+                created = makeCompany(nextIndex++, rng);
+            else
+            {
+                created = companies[cancelled.back()];
+                cancelled.pop_back();
+            }
+            start = chrono::steady_clock::now();
+            success = reg.newCompany(created.m_name, created.m_address, created.m_taxId);
+            end = chrono::steady_clock::now();
+            break;
+        }
+        case OP_INVOICE:
+        {
+            unsigned int amount = amountDistribution(rng);
+            start = chrono::steady_clock::now();
+            success = reg.invoice(company.m_taxId, amount);
+            end = chrono::steady_clock::now();
+            break;
+        }
+        case OP_AUDIT:
+        {
+            // Look up with different letter case than the company was registered with
+            string name = mixCase(company.m_name, rng);
+            string address = mixCase(company.m_address, rng);
+            unsigned int sum = 0;
+            start = chrono::steady_clock::now();
+            success = reg.audit(name, address, sum);
+            end = chrono::steady_clock::now();
+            break;
+        }
+        case OP_CANCEL:
+        {
+            size_t index = rng() % companiesCount;
+            start = chrono::steady_clock::now();
+            success = reg.cancelCompany(companies[index].m_taxId);
+            end = chrono::steady_clock::now();
+            if (success)
+                cancelled.push_back(index);
+            break;
+        }
+        default:
+            start = chrono::steady_clock::now();
+            reg.medianInvoice();
+            end = chrono::steady_clock::now();
+            break;
+        }
+
+        latencies[op].push_back(chrono::duration_cast<chrono::nanoseconds>(end - start).count());
+        failures[op] += !success;
+    }
+    printResults(companiesCount, "mixed", latencies, failures, chrono::duration<double>(chrono::steady_clock::now() - phaseStart).count(), results);
+}
+
+/**
+ * @brief Store results as "name value" lines
+ */
+static bool saveBaseline(const string &path, const vector<TResult> &results)
+{
+    ofstream ofs(path);
+    for (const auto &result : results)
+        ofs << result.m_name << ' ' << fixed << setprecision(1) << result.m_value << '\n';
+
+    return ofs.good();
+}
+
+/**
+ * @brief Compare results with the baseline, print every measurement that got worse by more than threshold
+ *
+ * Measurements missing in the baseline (e.g. other scales) are not compared.
+ *
+ * @return int Count of regressions, -1 if baseline couldn't be read
+ */
+static int compareBaseline(const string &path, const vector<TResult> &results, double threshold)
+{
+    ifstream ifs(path);
+    if (!ifs.is_open())
+        return -1;
+
+    unordered_map<string, double> baseline;
+    string name;
+    double value;
+    while (ifs >> name >> value)
+        baseline[name] = value;
+
+    int regressions = 0;
+    for (const auto &result : results)
+    {
+        auto iter = baseline.find(result.m_name);
+        if (iter == baseline.end() || iter->second <= 0)
+            continue;
+
+        double change = (result.m_value - iter->second) / iter->second;
+        if (result.m_higherIsBetter)
+            change = -change;
+
+        if (change > threshold)
+        {
+            cout << "REGRESSION " << result.m_name << ": " << fixed << setprecision(1) << iter->second
+                 << " -> " << result.m_value << " (" << setprecision(0) << change * 100 << " % worse)" << endl;
+            regressions++;
+        }
+    }
+
+    return regressions;
+}
+
+int main(int argc, char *argv[])
+{
+    vector<size_t> scales;
+    string baselinePath, saveBaselinePath;
+    double threshold = 0.2;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--baseline" && i + 1 < argc)
+            baselinePath = argv[++i];
+        else if (arg == "--save-baseline" && i + 1 < argc)
+            saveBaselinePath = argv[++i];
+        else if (arg == "--threshold" && i + 1 < argc)
+            threshold = strtod(argv[++i], nullptr) / 100.0;
+        else
+            scales.push_back(strtoull(argv[i], nullptr, 10));
+    }
+
+    if (scales.empty())
+        scales = {1000, 10000, 100000};
+
+    vector<TResult> results;
+    for (size_t scale : scales)
+        if (scale > 0)
+            runScale(scale, 42, results);
+
+    if (!saveBaselinePath.empty() && !saveBaseline(saveBaselinePath, results))
+    {
+        cerr << "cannot write baseline " << saveBaselinePath << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (!baselinePath.empty())
+    {
+        int regressions = compareBaseline(baselinePath, results, threshold);
+        if (regressions < 0)
+        {
+            cerr << "cannot read baseline " << baselinePath << endl;
+            return EXIT_FAILURE;
+        }
+
+        cout << regressions << " regression(s) over " << setprecision(0) << threshold * 100 << " % threshold" << endl;
+        if (regressions > 0)
+            return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
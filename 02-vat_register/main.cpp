@@ -11,176 +11,3037 @@
 #include <cstdio>
 #include <cctype>
 #include <cmath>
+#include <climits>
 #include <cassert>
 #include <iostream>
 #include <iomanip>
 #include <string>
 #include <vector>
 #include <list>
+#include <deque>
+#include <set>
+#include <unordered_map>
+#include <ctime>
 #include <algorithm>
 #include <memory>
+#include <fstream>
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <cerrno>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 using namespace std;
 #endif /* __PROGTEST__ */
 
-class CVATRegister
+/**
+ * @brief Helpers for writing files so that a crash leaves either the old or the new content on disk
+ */
+class CDurableFile
 {
 
-private:
-    // Alias for shared_ptr iterator in vector of T
-    template <typename T>
-    using ptrIterator = typename vector<shared_ptr<T>>::const_iterator;
+public:
+    /**
+     * @brief Write whole buffer, retrying short and interrupted writes
+     *
+     * @param[in] fd
+     * @param[in] data
+     * @return true If all data was written
+     * @return false If writing failed
+     */
+    static bool writeAll(int fd, const string &data)
+    {
+        size_t written = 0;
+        while (written < data.size())
+        {
+            ssize_t res = ::write(fd, data.data() + written, data.size() - written);
+            if (res < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            written += res;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Sync the directory containing the file, so a rename or creation of the file is durable
+     *
+     * @param[in] path Path to the file (not to the directory)
+     * @return true If directory was synced
+     * @return false If directory couldn't be opened or synced
+     */
+    static bool syncDirectory(const string &path)
+    {
+        size_t slash = path.rfind('/');
+        string directory = slash == string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+
+        int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd < 0)
+            return false;
+
+        bool ok = ::fsync(fd) == 0;
+        ::close(fd);
+
+        return ok;
+    }
+
+    /**
+     * @brief Atomically replace content of the file, writes and syncs a temporary file which is then renamed
+     *
+     * @param[in] path
+     * @param[in] data New content of the file
+     * @return true If the new content is durable
+     * @return false If any step failed, the file then still has its old content
+     */
+    static bool replace(const string &path, const string &data)
+    {
+        string tmpPath = path + ".tmp";
+
+        int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+
+        bool ok = writeAll(fd, data) && ::fsync(fd) == 0;
+        ok = ::close(fd) == 0 && ok;
+
+        if (!ok || ::rename(tmpPath.c_str(), path.c_str()) != 0)
+        {
+            ::unlink(tmpPath.c_str());
+            return false;
+        }
+
+        return syncDirectory(path);
+    }
+};
+
+/**
+ * @brief Append-only binary log of register operations, written by a background thread with group commit
+ *
+ * append() only copies the record into memory buffer, the background thread periodically writes
+ * all buffered records at once and calls a single fsync for the whole group.
+ *
+ * The file starts with magic and format version, every record ends with CRC32 of its bytes. A record
+ * that is incomplete or fails the check ends the log, such torn tail is cut off before appending again.
+ */
+class COperationLog
+{
+
+public:
+    enum EOperation : uint8_t
+    {
+        NEW_COMPANY = 1,
+        CANCEL_BY_NAME = 2,
+        CANCEL_BY_ID = 3,
+        INVOICE_BY_ID = 4,
+        INVOICE_BY_NAME = 5,
+        INVOICE_AT_BY_ID = 6
+    };
 
-    struct TCompany
+    // Record read back by replay(), append() takes the fields directly
+    struct TRecord
     {
-        unsigned int m_invoicesSum = 0u;
+        uint64_t m_sequence;
+        EOperation m_operation;
+        unsigned int m_amount;
         string m_name;
         string m_address;
         string m_taxId;
-
-        TCompany(const string &name,
-                 const string &address,
-                 const string &taxId)
-            : m_name(name),
-              m_address(address),
-              m_taxId(taxId){};
+        int64_t m_timestamp;
     };
 
-    vector<shared_ptr<TCompany>> m_companiesByName;
-    vector<shared_ptr<TCompany>> m_companiesById;
-    vector<unsigned int> m_invoices;
+private:
+    static constexpr char LOG_MAGIC[4] = {'V', 'A', 'T', 'L'};
+    static const uint32_t LOG_VERSION = 1;
+    static const size_t LOG_HEADER_SIZE = sizeof(LOG_MAGIC) + sizeof(uint32_t);
+
+    // Sequence number, operation, amount, timestamp and lengths of the three strings
+    static const size_t RECORD_HEADER_SIZE = sizeof(uint64_t) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(int64_t) + 3 * sizeof(uint32_t);
+    static const size_t RECORD_CHECKSUM_SIZE = sizeof(uint32_t);
+    static const size_t FLUSH_THRESHOLD = 1 << 20;
+    static constexpr chrono::milliseconds FLUSH_INTERVAL{5};
+
+    int m_fd = -1;
+    thread m_flusher;
+
+    mutex m_mutex;
+    condition_variable m_appendedCond;
+    condition_variable m_flushedCond;
+    string m_pending;
+    uint64_t m_appendedBytes = 0;
+    uint64_t m_durableBytes = 0;
+    size_t m_flushWaiters = 0;
+    bool m_stop = false;
+    bool m_failed = false;
+
+    static void putUint(string &buffer, uint64_t value, size_t bytes)
+    {
+        for (size_t i = 0; i < bytes; i++)
+            buffer.push_back((char)((value >> (8 * i)) & 0xFF));
+    }
+
+    static uint64_t getUint(const char *data, size_t bytes)
+    {
+        uint64_t value = 0;
+        for (size_t i = 0; i < bytes; i++)
+            value |= (uint64_t)(unsigned char)data[i] << (8 * i);
+        return value;
+    }
 
     /**
-     * @brief Compare function for lower_bound, case-insensitive, compares lexicographically by name and then by address
+     * @brief CRC32 (IEEE polynomial, the same as zlib), table driven
+     */
+    static uint32_t crc32(const char *data, size_t size)
+    {
+        static const array<uint32_t, 256> table = []()
+        {
+            array<uint32_t, 256> result{};
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                uint32_t crc = i;
+                for (int bit = 0; bit < 8; bit++)
+                    crc = (crc >> 1) ^ ((crc & 1u) ? 0xEDB88320u : 0u);
+                result[i] = crc;
+            }
+            return result;
+        }();
+
+        uint32_t crc = 0xFFFFFFFFu;
+        for (size_t i = 0; i < size; i++)
+            crc = table[(crc ^ (unsigned char)data[i]) & 0xFFu] ^ (crc >> 8);
+
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    static string fileHeader(void)
+    {
+        string header(LOG_MAGIC, sizeof(LOG_MAGIC));
+        putUint(header, LOG_VERSION, sizeof(uint32_t));
+        return header;
+    }
+
+    /**
+     * @brief Parse records from the log content
      *
-     * @param a
-     * @param b
-     * @return true
-     * @return false
+     * @param[in] data Whole content of the log file
+     * @param[in] callback Called for every valid record
+     * @param[out] validSize Length of the valid prefix, the file header and all complete records with matching checksum
+     * @return true If the file header is valid (content shorter than the header counts as empty log)
+     * @return false If it is not a log file or it has unsupported version
      */
-    static bool nameComp(const shared_ptr<TCompany> &a, const shared_ptr<TCompany> &b)
+    static bool parse(const string &data, const function<void(const TRecord &)> &callback, size_t &validSize)
     {
-        // Compare names case-insensitively
-        int namesCompare = strcasecmp(a->m_name.c_str(), b->m_name.c_str());
+        validSize = 0;
 
-        // If they are the same, compare addresses
-        if (namesCompare == 0)
+        // File header itself was torn, nothing was logged yet
+        if (data.size() < LOG_HEADER_SIZE)
+            return true;
+
+        if (data.compare(0, LOG_HEADER_SIZE, fileHeader()) != 0)
+            return false;
+
+        size_t pos = LOG_HEADER_SIZE;
+        validSize = pos;
+
+        while (data.size() - pos >= RECORD_HEADER_SIZE)
         {
-            int addrCompare = strcasecmp(a->m_address.c_str(), b->m_address.c_str());
-            return (addrCompare < 0) ? true : false;
+            const char *header = data.data() + pos;
+
+            TRecord record;
+            record.m_sequence = getUint(header, 8);
+            record.m_operation = (EOperation)getUint(header + 8, 1);
+            record.m_amount = (unsigned int)getUint(header + 9, 4);
+            record.m_timestamp = (int64_t)getUint(header + 13, 8);
+
+            uint64_t nameLength = getUint(header + 21, 4);
+            uint64_t addressLength = getUint(header + 25, 4);
+            uint64_t taxIdLength = getUint(header + 29, 4);
+            uint64_t recordSize = RECORD_HEADER_SIZE + nameLength + addressLength + taxIdLength;
+
+            if (data.size() - pos < recordSize + RECORD_CHECKSUM_SIZE ||
+                getUint(header + recordSize, RECORD_CHECKSUM_SIZE) != crc32(header, recordSize))
+                break;
+
+            pos += RECORD_HEADER_SIZE;
+            record.m_name = data.substr(pos, nameLength);
+            pos += nameLength;
+            record.m_address = data.substr(pos, addressLength);
+            pos += addressLength;
+            record.m_taxId = data.substr(pos, taxIdLength);
+            pos += taxIdLength + RECORD_CHECKSUM_SIZE;
+
+            validSize = pos;
+            callback(record);
         }
 
-        return (namesCompare < 0) ? true : false;
-    };
+        return true;
+    }
+
+    static bool readFile(const string &path, string &data, bool &exists)
+    {
+        ifstream ifs(path, ios::binary);
+        exists = ifs.is_open();
+        if (!exists)
+            return true;
+
+        data.assign((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+        return !ifs.bad();
+    }
+
+    // Body of the background thread, writes and syncs all pending records as one group
+    void flushLoop()
+    {
+        unique_lock<mutex> lock(m_mutex);
+
+        while (true)
+        {
+            m_appendedCond.wait_for(lock, FLUSH_INTERVAL, [this]()
+                                    { return m_stop || (!m_pending.empty() && (m_flushWaiters > 0 || m_pending.size() >= FLUSH_THRESHOLD)); });
+
+            if (m_pending.empty())
+            {
+                if (m_stop)
+                    break;
+                continue;
+            }
+
+            string group;
+            group.swap(m_pending);
+
+            // Write without holding the lock, so append() never waits for the disk
+            lock.unlock();
+            bool ok = CDurableFile::writeAll(m_fd, group) && ::fsync(m_fd) == 0;
+            lock.lock();
+
+            if (!ok)
+                m_failed = true;
+
+            m_durableBytes += group.size();
+            m_flushedCond.notify_all();
+        }
+    }
+
+public:
+    COperationLog(void) = default;
+
+    COperationLog(const COperationLog &) = delete;
+    COperationLog &operator=(const COperationLog &) = delete;
+
+    ~COperationLog(void)
+    {
+        close();
+    }
 
     /**
-     * @brief Compare function for lower_bound, compares lexicographically by taxId
+     * @brief Open (or create) the log file for appending and start the background writer
      *
-     * @param a
-     * @param b
-     * @return true
-     * @return false
+     * Torn tail left by a crash is cut off first, so new records directly follow the last valid one.
+     *
+     * @param[in] path
+     * @return true If log was opened
+     * @return false If file couldn't be opened, or it is not a log file of this version
      */
-    static bool idComp(const shared_ptr<TCompany> &a, const shared_ptr<TCompany> &b)
+    bool open(const string &path)
     {
-        int idsCompare = strcmp(a->m_taxId.c_str(), b->m_taxId.c_str());
+        close();
 
-        return (idsCompare < 0) ? true : false;
-    };
+        string data;
+        size_t validSize = 0;
+        bool exists;
+        if (!readFile(path, data, exists) || !parse(data, [](const TRecord &) {}, validSize))
+            return false;
+
+        m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (m_fd < 0)
+            return false;
+
+        bool ok = true;
+        if (validSize < data.size())
+            ok = ::ftruncate(m_fd, validSize) == 0;
+
+        // New or empty log gets the file header, creating the file must be durable too
+        if (ok && validSize == 0)
+            ok = CDurableFile::writeAll(m_fd, fileHeader());
+
+        if (ok && (validSize < data.size() || validSize == 0))
+            ok = ::fsync(m_fd) == 0 && (exists || CDurableFile::syncDirectory(path));
+
+        if (!ok)
+        {
+            ::close(m_fd);
+            m_fd = -1;
+            return false;
+        }
+
+        m_stop = false;
+        m_failed = false;
+        m_flusher = thread(&COperationLog::flushLoop, this);
+
+        return true;
+    }
 
     /**
-     * @brief Search for company by name and adress
+     * @brief Write all pending records, stop the background writer and close the file
+     */
+    void close(void)
+    {
+        if (m_fd < 0)
+            return;
+
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_appendedCond.notify_one();
+        m_flusher.join();
+
+        ::close(m_fd);
+        m_fd = -1;
+    }
+
+    bool isOpen(void) const
+    {
+        return m_fd >= 0;
+    }
+
+    /**
+     * @brief Append operation to the log, doesn't wait for the disk
+     *
+     * Fields are serialized straight into the pending buffer, strings are not copied anywhere else.
      *
+     * @param[in] sequence
+     * @param[in] operation
      * @param[in] name
      * @param[in] address
-     * @param[out] result ptrIterator to the found company
-     * @return true If company was found
-     * @return false If company was NOT found
+     * @param[in] taxId
+     * @param[in] amount
+     * @param[in] timestamp
+     */
+    void append(uint64_t sequence,
+                EOperation operation,
+                const string &name,
+                const string &address,
+                const string &taxId,
+                unsigned int amount,
+                int64_t timestamp)
+    {
+        lock_guard<mutex> lock(m_mutex);
+
+        size_t oldSize = m_pending.size();
+        putUint(m_pending, sequence, sizeof(uint64_t));
+        putUint(m_pending, operation, sizeof(uint8_t));
+        putUint(m_pending, amount, sizeof(uint32_t));
+        putUint(m_pending, (uint64_t)timestamp, sizeof(int64_t));
+        putUint(m_pending, name.size(), sizeof(uint32_t));
+        putUint(m_pending, address.size(), sizeof(uint32_t));
+        putUint(m_pending, taxId.size(), sizeof(uint32_t));
+        m_pending += name;
+        m_pending += address;
+        m_pending += taxId;
+        putUint(m_pending, crc32(m_pending.data() + oldSize, m_pending.size() - oldSize), RECORD_CHECKSUM_SIZE);
+
+        m_appendedBytes += m_pending.size() - oldSize;
+
+        if (m_pending.size() >= FLUSH_THRESHOLD)
+            m_appendedCond.notify_one();
+    }
+
+    /**
+     * @brief Wait until all records appended so far are written and synced to disk
+     *
+     * @return true If all records are durable
+     * @return false If writing to the log failed
      */
-    bool searchCompanyByName(const string &name, const string &address, ptrIterator<TCompany> &result) const
+    bool flush(void)
     {
-        // Companies vector is empty, can't search
-        if (m_companiesByName.empty())
+        if (m_fd < 0)
             return false;
 
-        // Create dummy company for compare function
-        auto searchCompany = make_shared<TCompany>(name, address, "");
+        unique_lock<mutex> lock(m_mutex);
 
-        // Search for the existing company
-        auto iter = lower_bound(m_companiesByName.begin(), m_companiesByName.end(), searchCompany, nameComp);
+        uint64_t target = m_appendedBytes;
 
-        // If company doesn't exist
-        if (iter == m_companiesByName.end())
-        {
-            // Decrement the shared_ptr usage counter
-            searchCompany.reset();
+        m_flushWaiters++;
+        m_appendedCond.notify_one();
+        m_flushedCond.wait(lock, [this, target]()
+                           { return m_durableBytes >= target; });
+        m_flushWaiters--;
+
+        return !m_failed;
+    }
+
+    /**
+     * @brief Discard all records in the log file (the file header is kept), used after the register was saved to snapshot
+     *
+     * @return true If log was truncated
+     * @return false If writing or truncating the log failed
+     */
+    bool truncate(void)
+    {
+        if (!flush())
+            return false;
+
+        lock_guard<mutex> lock(m_mutex);
+        return ::ftruncate(m_fd, LOG_HEADER_SIZE) == 0 && ::fsync(m_fd) == 0;
+    }
+
+    /**
+     * @brief Read all records from log file, an incomplete or corrupted record ends the log (torn write)
+     *
+     * @param[in] path
+     * @param[in] callback Called for every record in the order they were appended
+     * @param[out] validSize If not null, set to length of the valid part of the file, bytes after it are torn tail
+     * @return true If log was read (missing log file is the same as empty log)
+     * @return false If log file couldn't be read, or it is not a log file of this version
+     */
+    static bool replay(const string &path, const function<void(const TRecord &)> &callback, uint64_t *validSize = nullptr)
+    {
+        string data;
+        bool exists;
+        size_t size = 0;
+
+        if (!readFile(path, data, exists) || !parse(data, callback, size))
             return false;
+
+        if (validSize)
+            *validSize = size;
+
+        return true;
+    }
+
+    /**
+     * @brief Cut torn tail found by replay() off the log file, so no new record is appended after it
+     *
+     * @param[in] path
+     * @param[in] validSize Length of the valid part of the file
+     * @return true If the file has no torn tail now
+     * @return false If truncating failed
+     */
+    static bool cutTornTail(const string &path, uint64_t validSize)
+    {
+        int fd = ::open(path.c_str(), O_WRONLY);
+        if (fd < 0)
+            return errno == ENOENT;
+
+        struct stat info;
+        bool ok = ::fstat(fd, &info) == 0;
+
+        if (ok && (uint64_t)info.st_size > validSize)
+            ok = ::ftruncate(fd, validSize) == 0 && ::fsync(fd) == 0;
+
+        ::close(fd);
+
+        return ok;
+    }
+};
+
+class CVATRegister
+{
+    // Composes registers as its shards, reads them through private lookups which don't record metrics
+    friend class CConcurrentVATRegister;
+
+private:
+    // Alias for iterator in vector of company IDs
+    using idIterator = vector<uint32_t>::const_iterator;
+
+    // Indexes are compacted once there is at least 1 tombstone per this count of companies
+    static const size_t COMPACT_RATIO = 4;
+    static const size_t COMPACT_MIN_TOMBSTONES = 64;
+    // Maximal count of index entries copied by one mutation while compacting, per index
+    static const size_t COMPACT_STEP = 256;
+
+    // Snapshot file layout: header, company records (in name order), taxId order (indexes to records),
+    // string pool and sorted invoice amounts. Everything is stored in native byte order.
+    struct TSnapshotHeader
+    {
+        char m_magic[4];
+        uint32_t m_version;
+        uint64_t m_companiesCount;
+        uint64_t m_invoicesCount;
+        uint64_t m_poolSize;
+        uint64_t m_logSequence;
+        double m_relativeError;
+        uint64_t m_bucketsCount;
+        uint64_t m_timedInvoicesCount;
+    };
+
+    // Name, address and taxId of a company are stored right after each other in the string pool
+    struct TSnapshotRecord
+    {
+        uint64_t m_poolOffset;
+        uint32_t m_nameLength;
+        uint32_t m_addressLength;
+        uint32_t m_taxIdLength;
+        uint32_t m_invoicesSum;
+    };
+
+    // Timestamped invoice, stored ordered by record and then by timestamp
+    struct TSnapshotTimedInvoice
+    {
+        uint32_t m_record;
+        uint32_t m_amount;
+        int64_t m_timestamp;
+    };
+
+    static constexpr char SNAPSHOT_MAGIC[4] = {'V', 'A', 'T', 'R'};
+    static const uint32_t SNAPSHOT_VERSION = 5;
+
+    /**
+     * @brief Size of the snapshot header in the given version, every version only appended fields to it
+     *
+     * Version 2 added the log sequence, version 3 the histogram and version 4 the timed invoices.
+     * Version 5 only changed layout of the histogram (exact counts of small amounts, finer buckets).
+     */
+    static size_t snapshotHeaderSize(uint32_t version)
+    {
+        switch (version)
+        {
+        case 1:
+            return offsetof(TSnapshotHeader, m_logSequence);
+        case 2:
+            return offsetof(TSnapshotHeader, m_relativeError);
+        case 3:
+            return offsetof(TSnapshotHeader, m_timedInvoicesCount);
+        default:
+            return sizeof(TSnapshotHeader);
+        }
+    }
+
+    /**
+     * @brief Histogram of invoice amounts with logarithmic buckets, used instead of storing every amount
+     *
+     * Reported amounts are integers, so rounding alone can be off by 0.5. Amounts below 1 / relativeError
+     * (where 0.5 is more than half of the relative error) are therefore counted exactly. Larger amounts go to
+     * logarithmic buckets, bucket j holds amounts in (gamma^(j-1), gamma^j] with gamma for half of the relative
+     * error, so the middle of the bucket plus rounding is within the relative error from any amount in it.
+     * Memory doesn't grow with number of invoices, it grows with 1 / relativeError.
+     */
+    struct TInvoiceHistogram
+    {
+        double m_relativeError;
+        double m_gamma;
+        double m_logGamma;
+        uint64_t m_count = 0;
+
+        // Amounts below the limit are counted exactly, bucket j of larger amounts is stored at
+        // index m_exactLimit + j - m_firstBucket
+        unsigned int m_exactLimit;
+        size_t m_firstBucket;
+        vector<uint64_t> m_buckets;
+
+        /**
+         * @brief Create empty histogram
+         *
+         * @param relativeError Must be in range (0, 1), 0 would make gamma 1 (division by zero when indexing)
+         * and 1 or more makes gamma infinite or negative
+         * @throw invalid_argument If relativeError is out of range or NaN
+         */
+        TInvoiceHistogram(double relativeError)
+            : m_relativeError(relativeError)
+        {
+            if (!isValidRelativeError(relativeError))
+                throw invalid_argument("relative error must be in range (0, 1)");
+
+            m_gamma = (1.0 + relativeError / 2.0) / (1.0 - relativeError / 2.0);
+            m_logGamma = log(m_gamma);
+            m_exactLimit = (unsigned int)min(ceil(1.0 / relativeError), (double)UINT_MAX);
+            m_firstBucket = logBucket(m_exactLimit);
+            m_buckets.resize(index(UINT_MAX) + 1, 0);
+        }
+
+        static bool isValidRelativeError(double relativeError)
+        {
+            // Written so that NaN is rejected too
+            return relativeError > 0.0 && relativeError < 1.0;
+        }
+
+        size_t logBucket(unsigned int amount) const
+        {
+            return (size_t)ceil(log((double)amount) / m_logGamma);
+        }
+
+        size_t index(unsigned int amount) const
+        {
+            if (amount < m_exactLimit)
+                return amount;
+
+            return m_exactLimit + logBucket(amount) - m_firstBucket;
+        }
+
+        void add(unsigned int amount, uint64_t count = 1)
+        {
+            m_buckets[index(amount)] += count;
+            m_count += count;
+        }
+
+        /**
+         * @brief Get estimate of the k-th smallest amount
+         *
+         * @param k Zero-based order, must be lower than m_count
+         * @return unsigned int
+         */
+        unsigned int kth(uint64_t k) const
+        {
+            size_t position = 0;
+            while (k >= m_buckets[position])
+                k -= m_buckets[position++];
+
+            if (position < m_exactLimit)
+                return (unsigned int)position;
+
+            // Middle of the bucket (in the relative sense) has the lowest relative error, it is kept
+            // within the integers that belong to the bucket
+            double bucket = (double)(position - m_exactLimit + m_firstBucket);
+            double lower = max(floor(pow(m_gamma, bucket - 1.0)) + 1.0, (double)m_exactLimit);
+            double upper = min(floor(pow(m_gamma, bucket)), (double)UINT_MAX);
+            double estimate = round(2.0 * pow(m_gamma, bucket) / (m_gamma + 1.0));
+
+            if (lower <= upper)
+                estimate = min(max(estimate, lower), upper);
+
+            return (unsigned int)min(estimate, (double)UINT_MAX);
         }
 
-        // Check values are same
-        if (strcasecmp(name.c_str(), (*iter)->m_name.c_str()) != 0 ||
-            strcasecmp(address.c_str(), (*iter)->m_address.c_str()) != 0)
-        {
-            // Decrement the shared_ptr usage counter
-            searchCompany.reset();
+        /**
+         * @brief Count of buckets in snapshots before version 5, bucket 0 was for amount 0 and bucket i
+         * held amounts in (g^(i-2), g^(i-1)] with g for the full relative error
+         */
+        static size_t legacyBucketsCount(double relativeError)
+        {
+            double gamma = (1.0 + relativeError) / (1.0 - relativeError);
+            return (size_t)ceil(log((double)UINT_MAX) / log(gamma)) + 2;
+        }
+
+        /**
+         * @brief Add counts from buckets of snapshot before version 5, each bucket by its old estimate
+         */
+        void addLegacyBuckets(const vector<uint64_t> &buckets)
+        {
+            double gamma = (1.0 + m_relativeError) / (1.0 - m_relativeError);
+
+            add(0u, buckets[0]);
+            for (size_t i = 1; i < buckets.size(); i++)
+                if (buckets[i] > 0)
+                    add((unsigned int)min(round(2.0 * pow(gamma, (double)(i - 1)) / (gamma + 1.0)), (double)UINT_MAX), buckets[i]);
+        }
+    };
+
+    // Companies are stored as struct of arrays indexed by company ID. Name, address and taxId of a company
+    // are stored in the string pool right after each other, each of them terminated by '\0'.
+    string m_pool;
+    vector<uint64_t> m_poolOffsets;
+    vector<uint32_t> m_nameLengths;
+    vector<uint32_t> m_addressLengths;
+    vector<unsigned int> m_invoicesSums;
+
+    // Cancelled companies stay in the indexes as tombstones until the next compaction
+    vector<bool> m_cancelled;
+
+    // Company IDs ordered by name and address, and by taxId
+    vector<uint32_t> m_companiesByName;
+    vector<uint32_t> m_companiesById;
+
+    vector<unsigned int> m_invoices;
+
+    // Only used in approximate mode, m_invoices stays empty then
+    unique_ptr<TInvoiceHistogram> m_histogram;
+
+    // False in the mode without amounts, then neither m_invoices nor the histogram are filled
+    bool m_storeAmounts = true;
+
+    // Count of cancelled companies still present in each index, they differ after compaction, as a company
+    // cancelled while the indexes are being copied may be skipped in one of them and copied in the other
+    size_t m_nameTombstones = 0;
+    size_t m_idTombstones = 0;
+
+    // Indexes are compacted incrementally: every mutation copies a few more live entries to the new indexes,
+    // which replace the old ones once complete. Lookups keep using the old, complete indexes meanwhile.
+    bool m_compacting = false;
+    vector<uint32_t> m_compactedByName;
+    vector<uint32_t> m_compactedById;
+    size_t m_compactNameCursor = 0;
+    size_t m_compactIdCursor = 0;
+    size_t m_compactNameSkipped = 0;
+    size_t m_compactIdSkipped = 0;
+
+    /**
+     * @brief Timestamped invoices of one company, ordered by time
+     *
+     * Invoices are kept in a treap (randomized balanced search tree) ordered by timestamp, every node knows
+     * count and sum of amounts in its subtree. Adding an invoice, also a late one, and finding sum and count
+     * of invoices in any time window both take O(log n) expected time. Nodes are stored in a vector and
+     * linked by indexes.
+     */
+    struct TInvoiceTimeline
+    {
+        static const uint32_t NIL = UINT32_MAX;
+
+        struct TNode
+        {
+            int64_t m_timestamp;
+            uint64_t m_sum;
+            uint32_t m_amount;
+            uint32_t m_priority;
+            uint32_t m_count;
+            uint32_t m_left;
+            uint32_t m_right;
+        };
+
+        vector<TNode> m_nodes;
+        uint32_t m_root = NIL;
+        uint32_t m_seed = 2463534242u;
+
+        uint32_t countOf(uint32_t node) const
+        {
+            return node == NIL ? 0 : m_nodes[node].m_count;
+        }
+
+        uint64_t sumOf(uint32_t node) const
+        {
+            return node == NIL ? 0 : m_nodes[node].m_sum;
+        }
+
+        void update(uint32_t node)
+        {
+            TNode &n = m_nodes[node];
+            n.m_count = 1 + countOf(n.m_left) + countOf(n.m_right);
+            n.m_sum = n.m_amount + sumOf(n.m_left) + sumOf(n.m_right);
+        }
+
+        // Split subtree to nodes with timestamp <= timestamp and the rest
+        void split(uint32_t node, int64_t timestamp, uint32_t &left, uint32_t &right)
+        {
+            if (node == NIL)
+            {
+                left = right = NIL;
+                return;
+            }
+
+            if (m_nodes[node].m_timestamp <= timestamp)
+            {
+                split(m_nodes[node].m_right, timestamp, m_nodes[node].m_right, right);
+                left = node;
+            }
+            else
+            {
+                split(m_nodes[node].m_left, timestamp, left, m_nodes[node].m_left);
+                right = node;
+            }
+
+            update(node);
+        }
+
+        // Merge two subtrees, all timestamps in left are before all timestamps in right
+        uint32_t merge(uint32_t left, uint32_t right)
+        {
+            if (left == NIL || right == NIL)
+                return left == NIL ? right : left;
+
+            if (m_nodes[left].m_priority > m_nodes[right].m_priority)
+            {
+                m_nodes[left].m_right = merge(m_nodes[left].m_right, right);
+                update(left);
+                return left;
+            }
+
+            m_nodes[right].m_left = merge(left, m_nodes[right].m_left);
+            update(right);
+            return right;
+        }
+
+        void add(int64_t timestamp, unsigned int amount)
+        {
+            // xorshift32, priorities only need to be independent of the timestamps
+            m_seed ^= m_seed << 13;
+            m_seed ^= m_seed >> 17;
+            m_seed ^= m_seed << 5;
+
+            uint32_t node = (uint32_t)m_nodes.size();
+            m_nodes.push_back({timestamp, amount, amount, m_seed, 1, NIL, NIL});
+
+            // Invoices with the same timestamp stay in the order they were added
+            uint32_t left, right;
+            split(m_root, timestamp, left, right);
+            m_root = merge(merge(left, node), right);
+        }
+
+        size_t size(void) const
+        {
+            return m_nodes.size();
+        }
+
+        /**
+         * @brief Count and sum of invoices with timestamp before the given one (or equal, if inclusive)
+         */
+        void prefix(int64_t timestamp, bool inclusive, uint64_t &sum, size_t &count) const
+        {
+            sum = 0;
+            count = 0;
+
+            uint32_t node = m_root;
+            while (node != NIL)
+            {
+                const TNode &n = m_nodes[node];
+                if (n.m_timestamp < timestamp || (inclusive && n.m_timestamp == timestamp))
+                {
+                    sum += sumOf(n.m_left) + n.m_amount;
+                    count += countOf(n.m_left) + 1;
+                    node = n.m_right;
+                }
+                else
+                    node = n.m_left;
+            }
+        }
+
+        void query(int64_t from, int64_t to, uint64_t &sum, size_t &count) const
+        {
+            sum = 0;
+            count = 0;
+            if (to < from)
+                return;
+
+            uint64_t beforeSum;
+            size_t beforeCount;
+            prefix(to, true, sum, count);
+            prefix(from, false, beforeSum, beforeCount);
+
+            sum -= beforeSum;
+            count -= beforeCount;
+        }
+
+        /**
+         * @brief Call visitor(timestamp, amount) for every invoice in time order
+         */
+        template <typename TVisitor>
+        void forEach(TVisitor visitor) const
+        {
+            vector<uint32_t> stack;
+            uint32_t node = m_root;
+
+            while (node != NIL || !stack.empty())
+            {
+                while (node != NIL)
+                {
+                    stack.push_back(node);
+                    node = m_nodes[node].m_left;
+                }
+
+                node = stack.back();
+                stack.pop_back();
+                visitor(m_nodes[node].m_timestamp, m_nodes[node].m_amount);
+                node = m_nodes[node].m_right;
+            }
+        }
+    };
+
+    // Only companies with timestamped invoices have a timeline, key is company ID
+    unordered_map<uint32_t, TInvoiceTimeline> m_timelines;
+
+    // Orders companies by invoices sum (highest first), ties by name and address
+    struct TTotalComp
+    {
+        const CVATRegister *m_register;
+
+        bool operator()(uint32_t a, uint32_t b) const
+        {
+            if (m_register->m_invoicesSums[a] != m_register->m_invoicesSums[b])
+                return m_register->m_invoicesSums[a] > m_register->m_invoicesSums[b];
+
+            return m_register->nameLess(a, m_register->nameOf(b), m_register->addressOf(b));
+        }
+    };
+
+    // All not cancelled companies ordered by invoices sum, kept up to date by every invoice
+    set<uint32_t, TTotalComp> m_companiesByTotal{TTotalComp{this}};
+
+    const char *nameOf(uint32_t id) const
+    {
+        return m_pool.data() + m_poolOffsets[id];
+    }
+
+    const char *addressOf(uint32_t id) const
+    {
+        return nameOf(id) + m_nameLengths[id] + 1;
+    }
+
+    const char *taxIdOf(uint32_t id) const
+    {
+        return addressOf(id) + m_addressLengths[id] + 1;
+    }
+
+    /**
+     * @brief Append company to the arrays and its strings to the string pool
+     *
+     * @param name
+     * @param address
+     * @param taxId
+     * @return uint32_t ID of the new company
+     */
+    uint32_t addCompany(const char *name, size_t nameLength,
+                        const char *address, size_t addressLength,
+                        const char *taxId, size_t taxIdLength)
+    {
+        uint32_t id = (uint32_t)m_poolOffsets.size();
+
+        m_poolOffsets.push_back(m_pool.size());
+        m_nameLengths.push_back((uint32_t)nameLength);
+        m_addressLengths.push_back((uint32_t)addressLength);
+        m_invoicesSums.push_back(0u);
+        m_cancelled.push_back(false);
+
+        m_pool.append(name, nameLength).push_back('\0');
+        m_pool.append(address, addressLength).push_back('\0');
+        m_pool.append(taxId, taxIdLength).push_back('\0');
+
+        return id;
+    }
+
+    /**
+     * @brief Add amount to company's invoices sum, keeps the company on correct place in m_companiesByTotal
+     *
+     * @param id
+     * @param amount
+     */
+    void addToSum(uint32_t id, unsigned int amount)
+    {
+        m_companiesByTotal.erase(id);
+        m_invoicesSums[id] += amount;
+        m_companiesByTotal.insert(id);
+    }
+
+    /**
+     * @brief Mark company as cancelled, start compaction of the indexes if there are too many tombstones
+     *
+     * @param id
+     */
+    void cancel(uint32_t id)
+    {
+        m_companiesByTotal.erase(id);
+        m_timelines.erase(id);
+
+        m_cancelled[id] = true;
+        m_nameTombstones++;
+        m_idTombstones++;
+
+        // Both indexes are compacted together, once either of them has too many tombstones
+        auto tooManyTombstones = [](size_t tombstones, size_t size)
+        {
+            return tombstones >= COMPACT_MIN_TOMBSTONES && tombstones * COMPACT_RATIO >= size;
+        };
+
+        if (!m_compacting && (tooManyTombstones(m_nameTombstones, m_companiesByName.size()) ||
+                              tooManyTombstones(m_idTombstones, m_companiesById.size())))
+        {
+            m_compacting = true;
+            m_compactedByName.reserve(m_companiesByName.size() - m_nameTombstones);
+            m_compactedById.reserve(m_companiesById.size() - m_idTombstones);
+        }
+
+        compactStep();
+    }
+
+    /**
+     * @brief Copy at most COMPACT_STEP more entries of each index, skipping tombstones, swap the indexes when done
+     *
+     * Called by every mutation, so compaction costs O(1) per call instead of an O(n) pause.
+     */
+    void compactStep(void)
+    {
+        if (!m_compacting)
+            return;
+
+        size_t moves = 0;
+
+        for (size_t end = min(m_companiesByName.size(), m_compactNameCursor + COMPACT_STEP); m_compactNameCursor < end; moves++)
+        {
+            uint32_t id = m_companiesByName[m_compactNameCursor++];
+            if (m_cancelled[id])
+                m_compactNameSkipped++;
+            else
+                m_compactedByName.push_back(id);
+        }
+
+        for (size_t end = min(m_companiesById.size(), m_compactIdCursor + COMPACT_STEP); m_compactIdCursor < end; moves++)
+        {
+            uint32_t id = m_companiesById[m_compactIdCursor++];
+            if (m_cancelled[id])
+                m_compactIdSkipped++;
+            else
+                m_compactedById.push_back(id);
+        }
+
+        m_metrics.m_compactionMoves += moves;
+        m_metrics.m_maxCompactionMoves = max(m_metrics.m_maxCompactionMoves, (uint64_t)moves);
+
+        if (m_compactNameCursor < m_companiesByName.size() || m_compactIdCursor < m_companiesById.size())
+            return;
+
+        // Companies cancelled after they were copied stay in the new indexes as tombstones
+        m_companiesByName.swap(m_compactedByName);
+        m_companiesById.swap(m_compactedById);
+        m_nameTombstones -= m_compactNameSkipped;
+        m_idTombstones -= m_compactIdSkipped;
+        m_metrics.m_compactions++;
+
+        stopCompaction();
+    }
+
+    /**
+     * @brief Abandon compaction in progress and release the partial indexes
+     */
+    void stopCompaction(void)
+    {
+        m_compacting = false;
+        vector<uint32_t>().swap(m_compactedByName);
+        vector<uint32_t>().swap(m_compactedById);
+        m_compactNameCursor = 0;
+        m_compactIdCursor = 0;
+        m_compactNameSkipped = 0;
+        m_compactIdSkipped = 0;
+    }
+
+    // Sequence number of the last change, stored in snapshot so log replay can skip already saved operations
+    uint64_t m_logSequence = 0;
+    unique_ptr<COperationLog> m_log;
+
+    /**
+     * @brief Add amount to invoices, either to the sorted vector, or to the histogram in approximate mode,
+     * the amount is dropped in the mode without amounts
+     *
+     * @param amount
+     */
+    void addInvoiceAmount(unsigned int amount)
+    {
+        if (!m_storeAmounts)
+            return;
+
+        if (m_histogram)
+        {
+            m_histogram->add(amount);
+            return;
+        }
+
+        auto invoiceIter = lower_bound(m_invoices.begin(), m_invoices.end(), amount);
+        m_invoices.insert(invoiceIter, amount);
+    }
+
+    /**
+     * @brief Count successful change and append it to the operation log, if the log is enabled
+     *
+     * @param operation
+     * @param name
+     * @param address
+     * @param taxId
+     * @param amount
+     * @param timestamp
+     */
+    void logOperation(COperationLog::EOperation operation,
+                      const string &name,
+                      const string &address,
+                      const string &taxId,
+                      unsigned int amount = 0u,
+                      int64_t timestamp = 0)
+    {
+        m_logSequence++;
+
+        if (m_log)
+            m_log->append(m_logSequence, operation, name, address, taxId, amount, timestamp);
+    }
+
+    /**
+     * @brief Compare function for lower_bound, case-insensitive, compares lexicographically by name and then by address
+     *
+     * @param id Company from the index
+     * @param name
+     * @param address
+     * @return true If company is before the searched name and address
+     * @return false
+     */
+    bool nameLess(uint32_t id, const char *name, const char *address) const
+    {
+        // Compare names case-insensitively
+        int namesCompare = strcasecmp(nameOf(id), name);
+
+        // If they are the same, compare addresses
+        if (namesCompare == 0)
+            return strcasecmp(addressOf(id), address) < 0;
+
+        return namesCompare < 0;
+    };
+
+    /**
+     * @brief Compare function for lower_bound, compares lexicographically by taxId
+     *
+     * @param id Company from the index
+     * @param taxId
+     * @return true If company is before the searched taxId
+     * @return false
+     */
+    bool idLess(uint32_t id, const char *taxId) const
+    {
+        return strcmp(taxIdOf(id), taxId) < 0;
+    };
+
+    idIterator lowerBoundByName(const vector<uint32_t> &index, const string &name, const string &address) const
+    {
+        return lower_bound(index.begin(), index.end(), name,
+                           [this, &address](uint32_t id, const string &name)
+                           { return nameLess(id, name.c_str(), address.c_str()); });
+    }
+
+    idIterator lowerBoundByName(const string &name, const string &address) const
+    {
+        return lowerBoundByName(m_companiesByName, name, address);
+    }
+
+    idIterator lowerBoundById(const vector<uint32_t> &index, const string &taxId) const
+    {
+        return lower_bound(index.begin(), index.end(), taxId,
+                           [this](uint32_t id, const string &taxId)
+                           { return idLess(id, taxId.c_str()); });
+    }
+
+    idIterator lowerBoundById(const string &taxId) const
+    {
+        return lowerBoundById(m_companiesById, taxId);
+    }
+
+    /**
+     * @brief Search for company by name and adress
+     *
+     * @param[in] name
+     * @param[in] address
+     * @param[out] result idIterator to the found company
+     * @return true If company was found
+     * @return false If company was NOT found
+     */
+    bool searchCompanyByName(const string &name, const string &address, idIterator &result) const
+    {
+        // Search for the existing company
+        auto iter = lowerBoundByName(name, address);
+
+        // Skip cancelled companies with the same name and address
+        while (iter != m_companiesByName.end() && m_cancelled[*iter] &&
+               strcasecmp(name.c_str(), nameOf(*iter)) == 0 &&
+               strcasecmp(address.c_str(), addressOf(*iter)) == 0)
+            iter++;
+
+        // If company doesn't exist
+        if (iter == m_companiesByName.end())
+            return false;
+
+        // Check values are same
+        if (m_cancelled[*iter] ||
+            strcasecmp(name.c_str(), nameOf(*iter)) != 0 ||
+            strcasecmp(address.c_str(), addressOf(*iter)) != 0)
+            return false;
+
+        result = iter;
+
+        return true;
+    }
+
+    /**
+     * @brief Search for company by taxId
+     *
+     * @param[in] taxId
+     * @param[out] result idIterator to the found company
+     * @return true If company was found
+     * @return false If company was NOT found
+     */
+    bool searchCompanyById(const string &taxId, idIterator &result) const
+    {
+        // Search for the existing company
+        auto iter = lowerBoundById(taxId);
+
+        // Skip cancelled companies with the same taxId
+        while (iter != m_companiesById.end() && m_cancelled[*iter] && strcmp(taxId.c_str(), taxIdOf(*iter)) == 0)
+            iter++;
+
+        // If company doesn't exist
+        if (iter == m_companiesById.end())
+            return false;
+
+        // Check values are same
+        if (m_cancelled[*iter] || strcmp(taxId.c_str(), taxIdOf(*iter)) != 0)
+            return false;
+
+        result = iter;
+
+        return true;
+    }
+
+public:
+    // Company with its invoices sum, returned by topCompanies()
+    struct TCompanyTotal
+    {
+        string m_name;
+        string m_address;
+        string m_taxId;
+        unsigned int m_invoicesSum;
+    };
+
+    /**
+     * @brief Walks companies in alphabetical order (by name and address), each step is O(1) without any searching
+     *
+     * Cursor is invalidated by adding or deleting companies, same as iterators of the underlying vector.
+     */
+    class CCompanyCursor
+    {
+    private:
+        const CVATRegister *m_register;
+        size_t m_index;
+
+        void skipCancelled(void)
+        {
+            while (valid() && m_register->m_cancelled[id()])
+                m_index++;
+        }
+
+        uint32_t id(void) const
+        {
+            return m_register->m_companiesByName[m_index];
+        }
+
+    public:
+        CCompanyCursor(const CVATRegister &reg, size_t index)
+            : m_register(&reg), m_index(index)
+        {
+            skipCancelled();
+        };
+
+        bool valid(void) const
+        {
+            return m_index < m_register->m_companiesByName.size();
+        }
+
+        CCompanyCursor &next(void)
+        {
+            m_index++;
+            skipCancelled();
+            return *this;
+        }
+
+        const char *name(void) const
+        {
+            return m_register->nameOf(id());
+        }
+
+        const char *address(void) const
+        {
+            return m_register->addressOf(id());
+        }
+
+        const char *taxId(void) const
+        {
+            return m_register->taxIdOf(id());
+        }
+
+        unsigned int invoicesSum(void) const
+        {
+            return m_register->m_invoicesSums[id()];
+        }
+    };
+
+    // Methods with collected metrics
+    enum EMethod
+    {
+        M_NEW_COMPANY,
+        M_CANCEL_COMPANY,
+        M_INVOICE,
+        M_INVOICE_AT,
+        M_INVOICE_BATCH,
+        M_AUDIT,
+        M_AUDIT_RANGE,
+        M_NEXT_COMPANY,
+        M_FIRST_COMPANY,
+        M_COMPANIES_WITH_PREFIX,
+        M_TOP_COMPANIES,
+        M_MEDIAN_INVOICE,
+        M_KTH_INVOICE,
+        M_QUANTILE_INVOICE,
+        METHODS_COUNT
+    };
+
+    static const char *methodName(EMethod method)
+    {
+        static const char *names[METHODS_COUNT] = {"newCompany", "cancelCompany", "invoice", "invoiceAt",
+                                                   "invoiceBatch", "audit", "auditRange", "nextCompany",
+                                                   "firstCompany", "companiesWithPrefix", "topCompanies",
+                                                   "medianInvoice", "kthInvoice", "quantileInvoice"};
+        return names[method];
+    }
+
+    // Counters of one method, hit is a call that returned true (company found, created, ...)
+    struct TMethodMetrics
+    {
+        uint64_t m_calls = 0;
+        uint64_t m_hits = 0;
+        uint64_t m_misses = 0;
+        uint64_t m_nanoseconds = 0;
+    };
+
+    // One of the slowest calls, key is the taxID or "name, address" the method was called with
+    struct TSlowOperation
+    {
+        EMethod m_method;
+        string m_key;
+        uint64_t m_nanoseconds;
+    };
+
+    struct TMetrics
+    {
+        array<TMethodMetrics, METHODS_COUNT> m_methods;
+        // Operations applied by recover(), they are not counted as calls of the methods
+        uint64_t m_replayedRecords = 0;
+        // Index entries copied by incremental compaction, in total and at most by one call
+        uint64_t m_compactionMoves = 0;
+        uint64_t m_maxCompactionMoves = 0;
+        uint64_t m_compactions = 0;
+        // Min-heap by duration while collecting, so the fastest of the kept calls is replaced first
+        vector<TSlowOperation> m_slowest;
+    };
+
+private:
+    // Counters of one method while collecting. Const methods only add to relaxed atomics (and update the slowest
+    // calls under m_slowestMutex), so they stay safe to call concurrently, e.g. under a reader lock.
+    struct TMethodCounters
+    {
+        atomic<uint64_t> m_calls{0};
+        atomic<uint64_t> m_hits{0};
+        atomic<uint64_t> m_misses{0};
+        atomic<uint64_t> m_nanoseconds{0};
+    };
+
+    // Calls and hits are always counted, durations only when timing is enabled
+    mutable array<TMethodCounters, METHODS_COUNT> m_methodCounters;
+    // Counters of mutations and the slowest calls, m_methods is only filled in the copy returned by metrics()
+    mutable TMetrics m_metrics;
+    // Guards m_metrics.m_slowest, the only part of m_metrics written by const methods
+    mutable mutex m_slowestMutex;
+    bool m_timingEnabled = false;
+    // Set while recover() replays the log, so replayed operations don't look like client calls
+    bool m_metricsSuspended = false;
+    size_t m_slowestLimit = 0;
+
+    static bool slowerThan(const TSlowOperation &a, const TSlowOperation &b)
+    {
+        return a.m_nanoseconds > b.m_nanoseconds;
+    }
+
+    /**
+     * @brief Counts call of a public method when leaving it, the method marks successful calls by hit()
+     *
+     * Key strings are only referenced, they are copied just when the call gets among the slowest ones.
+     */
+    class CMethodScope
+    {
+    private:
+        const CVATRegister &m_register;
+        EMethod m_method;
+        const string &m_key;
+        const string *m_address;
+        chrono::steady_clock::time_point m_start;
+        bool m_hit = false;
+
+    public:
+        CMethodScope(const CVATRegister &reg, EMethod method, const string &key, const string *address = nullptr)
+            : m_register(reg), m_method(method), m_key(key), m_address(address)
+        {
+            if (m_register.m_timingEnabled)
+                m_start = chrono::steady_clock::now();
+        };
+
+        ~CMethodScope(void)
+        {
+            if (m_register.m_metricsSuspended)
+                return;
+
+            TMethodCounters &counters = m_register.m_methodCounters[m_method];
+            counters.m_calls.fetch_add(1, memory_order_relaxed);
+            (m_hit ? counters.m_hits : counters.m_misses).fetch_add(1, memory_order_relaxed);
+
+            if (!m_register.m_timingEnabled)
+                return;
+
+            uint64_t duration = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - m_start).count();
+            counters.m_nanoseconds.fetch_add(duration, memory_order_relaxed);
+            m_register.recordSlowOperation(m_method, m_key, m_address, duration);
+        }
+
+        CMethodScope(const CMethodScope &) = delete;
+        CMethodScope &operator=(const CMethodScope &) = delete;
+
+        void hit(void)
+        {
+            m_hit = true;
+        }
+    };
+
+    /**
+     * @brief Keep the call if it is among the slowest ones, in O(log n)
+     *
+     * @param method
+     * @param key
+     * @param address Address for calls by name and address, nullptr otherwise
+     * @param duration
+     */
+    void recordSlowOperation(EMethod method, const string &key, const string *address, uint64_t duration) const
+    {
+        if (m_slowestLimit == 0)
+            return;
+
+        lock_guard<mutex> lock(m_slowestMutex);
+        vector<TSlowOperation> &slowest = m_metrics.m_slowest;
+
+        if (slowest.size() == m_slowestLimit && slowest.front().m_nanoseconds >= duration)
+            return;
+
+        if (slowest.size() == m_slowestLimit)
+        {
+            pop_heap(slowest.begin(), slowest.end(), slowerThan);
+            slowest.pop_back();
+        }
+
+        slowest.push_back({method, address ? key + ", " + *address : key, duration});
+        push_heap(slowest.begin(), slowest.end(), slowerThan);
+    }
+
+    /**
+     * @brief Escape label value for Prometheus text format
+     */
+    static string escapeLabel(const string &value)
+    {
+        string result;
+        for (char c : value)
+        {
+            if (c == '\\' || c == '"')
+                result.push_back('\\');
+
+            if (c == '\n')
+                result += "\\n";
+            else
+                result.push_back(c);
+        }
+        return result;
+    }
+
+    size_t invoicesCount(void) const
+    {
+        return m_histogram ? m_histogram->m_count : m_invoices.size();
+    }
+
+    /**
+     * @brief Get k-th smallest invoice (estimate in approximate mode), without recording metrics
+     *
+     * @param[in] k Zero-based order of the invoice
+     * @param[out] amount
+     * @return true If there are more than k invoices
+     * @return false If there are k or less invoices
+     */
+    bool kthAmount(size_t k, unsigned int &amount) const
+    {
+        if (k >= invoicesCount())
+            return false;
+
+        amount = m_histogram ? m_histogram->kth(k) : m_invoices[k];
+
+        return true;
+    }
+
+    /**
+     * @brief Body of load(), may throw if allocation fails
+     *
+     * @param[in] path
+     * @return true If snapshot was loaded
+     * @return false If file couldn't be read or is not valid, register is left unchanged
+     */
+    bool loadSnapshot(const string &path)
+    {
+        ifstream ifs(path, ios::binary | ios::ate);
+        if (!ifs.is_open())
+            return false;
+
+        streamoff fileSize = ifs.tellg();
+        if (fileSize < 0 || !ifs.seekg(0))
+            return false;
+
+        // Older versions have shorter header, fields added later stay zero
+        TSnapshotHeader header = {};
+        size_t versionEnd = offsetof(TSnapshotHeader, m_companiesCount);
+        if (!ifs.read((char *)&header, versionEnd) ||
+            memcmp(header.m_magic, SNAPSHOT_MAGIC, sizeof(header.m_magic)) != 0 ||
+            header.m_version < 1 || header.m_version > SNAPSHOT_VERSION)
+            return false;
+
+        size_t headerSize = snapshotHeaderSize(header.m_version);
+        if ((uint64_t)fileSize < headerSize || !ifs.read((char *)&header + versionEnd, headerSize - versionEnd))
+            return false;
+
+        // Every count from the header is checked against the bytes left in the file before anything is allocated
+        uint64_t remaining = (uint64_t)fileSize - headerSize;
+        auto take = [&remaining](uint64_t count, uint64_t elementSize)
+        {
+            if (count > remaining / elementSize)
+                return false;
+
+            remaining -= count * elementSize;
+            return true;
+        };
+
+        if (!take(header.m_companiesCount, sizeof(TSnapshotRecord) + sizeof(uint32_t)) ||
+            !take(header.m_poolSize, 1) ||
+            !take(header.m_invoicesCount, sizeof(unsigned int)) ||
+            !take(header.m_bucketsCount, sizeof(uint64_t)) ||
+            !take(header.m_timedInvoicesCount, sizeof(TSnapshotTimedInvoice)) ||
+            remaining != 0)
+            return false;
+
+        vector<TSnapshotRecord> records(header.m_companiesCount);
+        vector<uint32_t> idOrder(header.m_companiesCount);
+        string pool(header.m_poolSize, '\0');
+        vector<unsigned int> invoices(header.m_invoicesCount);
+
+        if (!ifs.read((char *)records.data(), records.size() * sizeof(TSnapshotRecord)) ||
+            !ifs.read((char *)idOrder.data(), idOrder.size() * sizeof(uint32_t)) ||
+            !ifs.read(&pool[0], pool.size()) ||
+            !ifs.read((char *)invoices.data(), invoices.size() * sizeof(unsigned int)) ||
+            !is_sorted(invoices.begin(), invoices.end()))
+            return false;
+
+        // Snapshot of register in approximate mode also contains the histogram
+        unique_ptr<TInvoiceHistogram> histogram;
+        if (header.m_relativeError != 0.0)
+        {
+            if (!TInvoiceHistogram::isValidRelativeError(header.m_relativeError))
+                return false;
+
+            histogram = make_unique<TInvoiceHistogram>(header.m_relativeError);
+
+            // Older histograms had different buckets, their counts are moved to the current ones
+            bool legacy = header.m_version < 5;
+            size_t bucketsCount = legacy ? TInvoiceHistogram::legacyBucketsCount(header.m_relativeError) : histogram->m_buckets.size();
+            vector<uint64_t> buckets(bucketsCount);
+
+            if (bucketsCount != header.m_bucketsCount ||
+                !ifs.read((char *)buckets.data(), buckets.size() * sizeof(uint64_t)))
+                return false;
+
+            if (legacy)
+                histogram->addLegacyBuckets(buckets);
+            else
+            {
+                histogram->m_buckets.swap(buckets);
+                for (uint64_t bucket : histogram->m_buckets)
+                    histogram->m_count += bucket;
+            }
+        }
+
+        vector<TSnapshotTimedInvoice> timedInvoices(header.m_timedInvoicesCount);
+        if (!ifs.read((char *)timedInvoices.data(), timedInvoices.size() * sizeof(TSnapshotTimedInvoice)))
+            return false;
+
+        // Records are in name order, so record index becomes the company ID
+        CVATRegister loaded;
+        loaded.m_pool.reserve(pool.size() + 3 * records.size());
+
+        // Lookups binary search the indexes, so they must be strictly sorted (which also rules out duplicates).
+        // Strings are terminated by '\0' in the pool, so they can't contain it.
+        for (const auto &record : records)
+        {
+            uint64_t length = (uint64_t)record.m_nameLength + record.m_addressLength + record.m_taxIdLength;
+            if (record.m_poolOffset > pool.size() || length > pool.size() - record.m_poolOffset)
+                return false;
+
+            const char *data = pool.data() + record.m_poolOffset;
+            if (memchr(data, '\0', length))
+                return false;
+
+            uint32_t id = loaded.addCompany(data, record.m_nameLength,
+                                            data + record.m_nameLength, record.m_addressLength,
+                                            data + record.m_nameLength + record.m_addressLength, record.m_taxIdLength);
+            if (id > 0 && !loaded.nameLess(id - 1, loaded.nameOf(id), loaded.addressOf(id)))
+                return false;
+
+            loaded.m_invoicesSums[id] = record.m_invoicesSum;
+            loaded.m_companiesByName.push_back(id);
+        }
+
+        // Index into records with every record exactly once, strictly sorted taxIds make it a permutation
+        for (uint32_t index : idOrder)
+        {
+            if (index >= records.size() ||
+                (!loaded.m_companiesById.empty() && !loaded.idLess(loaded.m_companiesById.back(), loaded.taxIdOf(index))))
+                return false;
+
+            loaded.m_companiesById.push_back(index);
+        }
+
+        // Timed invoices are stored by record and in time order of every company
+        for (size_t i = 0; i < timedInvoices.size(); i++)
+        {
+            const TSnapshotTimedInvoice &timedInvoice = timedInvoices[i];
+            if (timedInvoice.m_record >= records.size() ||
+                (i > 0 && (timedInvoice.m_record < timedInvoices[i - 1].m_record ||
+                           (timedInvoice.m_record == timedInvoices[i - 1].m_record && timedInvoice.m_timestamp < timedInvoices[i - 1].m_timestamp))))
+                return false;
+
+            loaded.m_timelines[timedInvoice.m_record].add(timedInvoice.m_timestamp, timedInvoice.m_amount);
+        }
+
+        m_pool.swap(loaded.m_pool);
+        m_poolOffsets.swap(loaded.m_poolOffsets);
+        m_nameLengths.swap(loaded.m_nameLengths);
+        m_addressLengths.swap(loaded.m_addressLengths);
+        m_invoicesSums.swap(loaded.m_invoicesSums);
+        m_cancelled.swap(loaded.m_cancelled);
+        m_companiesByName.swap(loaded.m_companiesByName);
+        m_companiesById.swap(loaded.m_companiesById);
+        m_timelines.swap(loaded.m_timelines);
+
+        m_companiesByTotal.clear();
+        for (uint32_t id : m_companiesByName)
+            m_companiesByTotal.insert(id);
+
+        // Register without amounts stays so, amounts from the snapshot are dropped
+        if (m_storeAmounts)
+        {
+            m_invoices.swap(invoices);
+            m_histogram = move(histogram);
+        }
+        m_nameTombstones = 0;
+        m_idTombstones = 0;
+        stopCompaction();
+        m_logSequence = header.m_logSequence;
+
+        return true;
+    }
+
+public:
+    // Passed to the constructor to create register without invoice amounts
+    enum ENoAmounts
+    {
+        NO_AMOUNTS
+    };
+
+    CVATRegister(void) = default;
+
+    /**
+     * @brief Create register in approximate mode, invoice amounts are not stored, only counted in a histogram
+     *
+     * Median and quantiles are then reported with at most the given relative error, using constant memory.
+     *
+     * @param relativeError Maximal relative error of reported invoices, in range (0, 1), e.g. 0.01 for 1 %
+     * @throw invalid_argument If relativeError is not in range (0, 1)
+     */
+    explicit CVATRegister(double relativeError)
+        : m_histogram(make_unique<TInvoiceHistogram>(relativeError)){};
+
+    /**
+     * @brief Create register that keeps invoices sums of companies, but doesn't store invoice amounts at all
+     *
+     * For callers that keep the amounts on their own, median and quantiles then behave as if there were no invoices.
+     */
+    explicit CVATRegister(ENoAmounts)
+        : m_storeAmounts(false){};
+
+    ~CVATRegister(void) = default;
+
+    CVATRegister(const CVATRegister &) = delete;
+    CVATRegister &operator=(const CVATRegister &) = delete;
+
+    /**
+     * @brief Create a new company if it doesn't exist yet
+     *
+     * @param[in] name Name for the company, case-insensitive
+     * @param[in] addr Address for the company, case-insensitive
+     * @param[in] taxID TaxID for the company
+     * @return true If new company was added
+     * @return false If company already exists
+     */
+    bool newCompany(const string &name,
+                    const string &addr,
+                    const string &taxID)
+    {
+        CMethodScope scope(*this, M_NEW_COMPANY, taxID);
+        idIterator iter;
+
+        // Check the company doesn't exist yet, neither by name+addr nor by ID (cancelled companies are skipped)
+        if (searchCompanyByName(name, addr, iter) || searchCompanyById(taxID, iter))
+            return false;
+
+        // Find out the correct position where to insert
+        auto nameIter = lowerBoundByName(name, addr);
+        auto idIter = lowerBoundById(taxID);
+
+        uint32_t id = addCompany(name.data(), name.size(), addr.data(), addr.size(), taxID.data(), taxID.size());
+
+        // Compaction already went past the position, so the new indexes need the company too
+        if (m_compacting && (size_t)(nameIter - m_companiesByName.begin()) < m_compactNameCursor)
+        {
+            m_compactedByName.insert(lowerBoundByName(m_compactedByName, name, addr), id);
+            m_compactNameCursor++;
+        }
+
+        if (m_compacting && (size_t)(idIter - m_companiesById.begin()) < m_compactIdCursor)
+        {
+            m_compactedById.insert(lowerBoundById(m_compactedById, taxID), id);
+            m_compactIdCursor++;
+        }
+
+        // Insert the newly made company
+        m_companiesByName.insert(nameIter, id);
+        m_companiesById.insert(idIter, id);
+        m_companiesByTotal.insert(id);
+        compactStep();
+
+        logOperation(COperationLog::NEW_COMPANY, name, addr, taxID);
+
+        scope.hit();
+        return true;
+    };
+
+    /**
+     * @brief Delete company from database, by name and address (case-insensitive)
+     *
+     * Company is only marked as cancelled, it's removed from the vectors by incremental compaction later.
+     *
+     * @param[in] name
+     * @param[in] addr
+     * @return true If company was successfully deleted
+     * @return false If company wasn't found
+     */
+    bool cancelCompany(const string &name,
+                       const string &addr)
+    {
+        CMethodScope scope(*this, M_CANCEL_COMPANY, name, &addr);
+        idIterator iterName;
+
+        // Search for company
+        if (!searchCompanyByName(name, addr, iterName))
+            return false;
+
+        // Both indexes refer to the same company ID, so this marks it in both
+        cancel(*iterName);
+
+        logOperation(COperationLog::CANCEL_BY_NAME, name, addr, "");
+
+        scope.hit();
+        return true;
+    }
+
+    /**
+     * @brief Delete company from database, by taxID
+     *
+     * Company is only marked as cancelled, it's removed from the vectors by incremental compaction later.
+     *
+     * @param[in] taxID
+     * @return true If company was successfully deleted
+     * @return false If company wasn't found
+     */
+    bool cancelCompany(const string &taxID)
+    {
+        CMethodScope scope(*this, M_CANCEL_COMPANY, taxID);
+        idIterator iterId;
+
+        // Search for company
+        if (!searchCompanyById(taxID, iterId))
+            return false;
+
+        // Both indexes refer to the same company ID, so this marks it in both
+        cancel(*iterId);
+
+        logOperation(COperationLog::CANCEL_BY_ID, "", "", taxID);
+
+        scope.hit();
+        return true;
+    }
+
+    /**
+     * @brief Add a new invoice for company, by taxID
+     *
+     * @param[in] taxID
+     * @param[in] amount Amount of money to add
+     * @return true If amount was successfully added
+     * @return false If company wasn't found
+     */
+    bool invoice(const string &taxID,
+                 unsigned int amount)
+    {
+        CMethodScope scope(*this, M_INVOICE, taxID);
+        idIterator iter;
+
+        // Search for company
+        if (!searchCompanyById(taxID, iter))
+            return false;
+
+        // Add amount to found company
+        addToSum(*iter, amount);
+
+        // Add amount to invoices
+        addInvoiceAmount(amount);
+
+        logOperation(COperationLog::INVOICE_BY_ID, "", "", taxID, amount);
+
+        scope.hit();
+        return true;
+    }
+
+    /**
+     * @brief Add a new invoice for company, by name and address (case-insensitive)
+     *
+     * @param[in] name
+     * @param[in] addr
+     * @param[in] amount Amount of money to add
+     * @return true If amount was successfully added
+     * @return false If company wasn't found
+     */
+    bool invoice(const string &name,
+                 const string &addr,
+                 unsigned int amount)
+    {
+        CMethodScope scope(*this, M_INVOICE, name, &addr);
+        idIterator iter;
+
+        // Search for company
+        if (!searchCompanyByName(name, addr, iter))
+            return false;
+
+        // Add amount to found company
+        addToSum(*iter, amount);
+
+        // Add amount to invoices
+        addInvoiceAmount(amount);
+
+        logOperation(COperationLog::INVOICE_BY_NAME, name, addr, "", amount);
+
+        scope.hit();
+        return true;
+    }
+
+    /**
+     * @brief Add a new invoice with timestamp for company, by taxID, the invoice can be then found by auditRange()
+     *
+     * @param[in] taxID
+     * @param[in] amount Amount of money to add
+     * @param[in] timestamp Time of the invoice
+     * @return true If amount was successfully added
+     * @return false If company wasn't found
+     */
+    bool invoiceAt(const string &taxID,
+                   unsigned int amount,
+                   time_t timestamp)
+    {
+        CMethodScope scope(*this, M_INVOICE_AT, taxID);
+        idIterator iter;
+
+        // Search for company
+        if (!searchCompanyById(taxID, iter))
+            return false;
+
+        // Add amount to found company and to its timeline
+        addToSum(*iter, amount);
+        m_timelines[*iter].add(timestamp, amount);
+
+        // Add amount to invoices
+        addInvoiceAmount(amount);
+
+        logOperation(COperationLog::INVOICE_AT_BY_ID, "", "", taxID, amount, timestamp);
+
+        scope.hit();
+        return true;
+    }
+
+    /**
+     * @brief Add a batch of invoices at once, by taxID
+     *
+     * Amounts of all accepted invoices are sorted and merged into the invoices vector in one linear pass,
+     * instead of doing one vector insert per amount like invoice() does.
+     *
+     * Takes a view of the caller's array, so invoices from any contiguous container (or part of it)
+     * are added without copying them into a vector first.
+     *
+     * @param[in] batch Pairs of taxID and amount of money to add
+     * @param[in] batchSize Count of pairs in the batch
+     * @return size_t Count of invoices that were added (invoices for unknown companies are skipped)
+     */
+    size_t invoiceBatch(const pair<string, unsigned int> *batch, size_t batchSize)
+    {
+        static const string key = "batch";
+        CMethodScope scope(*this, M_INVOICE_BATCH, key);
+        vector<unsigned int> amounts;
+        amounts.reserve(m_histogram || !m_storeAmounts ? 0 : batchSize);
+        size_t count = 0;
+
+        for (size_t i = 0; i < batchSize; i++)
+        {
+            const auto &item = batch[i];
+            idIterator iter;
+
+            // Skip invoices for companies that don't exist
+            if (!searchCompanyById(item.first, iter))
+                continue;
+
+            // Add amount to found company
+            addToSum(*iter, item.second);
+            count++;
+
+            if (m_histogram)
+                m_histogram->add(item.second);
+            else if (m_storeAmounts)
+                amounts.push_back(item.second);
+
+            logOperation(COperationLog::INVOICE_BY_ID, "", "", item.first, item.second);
+        }
+
+        // Sort the new amounts and merge them with already sorted invoices
+        sort(amounts.begin(), amounts.end());
+
+        size_t oldSize = m_invoices.size();
+        m_invoices.insert(m_invoices.end(), amounts.begin(), amounts.end());
+        inplace_merge(m_invoices.begin(), m_invoices.begin() + oldSize, m_invoices.end());
+
+        // Batch is a hit when none of its invoices was skipped
+        if (count == batchSize)
+            scope.hit();
+
+        return count;
+    }
+
+    /**
+     * @brief Add a batch of invoices at once, by taxID
+     *
+     * @param[in] batch Pairs of taxID and amount of money to add
+     * @return size_t Count of invoices that were added (invoices for unknown companies are skipped)
+     */
+    size_t invoiceBatch(const vector<pair<string, unsigned int>> &batch)
+    {
+        return invoiceBatch(batch.data(), batch.size());
+    }
+
+    /**
+     * @brief Get sum of invoices amounts from company, by name and address (case-insensitive)
+     *
+     * @param[in] name
+     * @param[in] addr
+     * @param[out] sumIncome Sum of all company's invoices
+     * @return true If company was found
+     * @return false If company was NOT found
+     */
+    bool audit(const string &name,
+               const string &addr,
+               unsigned int &sumIncome) const
+    {
+        CMethodScope scope(*this, M_AUDIT, name, &addr);
+        idIterator iter;
+
+        // Search for company
+        if (!searchCompanyByName(name, addr, iter))
+            return false;
+
+        sumIncome = m_invoicesSums[*iter];
+
+        scope.hit();
+        return true;
+    }
+
+    /**
+     * @brief Get sum of invoices amounts from company, by taxId
+     *
+     * @param[in] taxID
+     * @param[out] sumIncome Sum of all company's invoices
+     * @return true If company was found
+     * @return false If company was NOT found
+     */
+    bool audit(const string &taxID,
+               unsigned int &sumIncome) const
+    {
+        CMethodScope scope(*this, M_AUDIT, taxID);
+        idIterator iter;
+
+        // Search for company
+        if (!searchCompanyById(taxID, iter))
+            return false;
+
+        sumIncome = m_invoicesSums[*iter];
+
+        scope.hit();
+        return true;
+    }
+
+    /**
+     * @brief Get sum and count of company's timestamped invoices in time window, by taxID, in O(log n)
+     *
+     * Only invoices added by invoiceAt() are counted.
+     *
+     * @param[in] taxID
+     * @param[in] from Start of the window (inclusive)
+     * @param[in] to End of the window (inclusive)
+     * @param[out] sumIncome Sum of invoices in the window
+     * @param[out] count Count of invoices in the window
+     * @return true If company was found
+     * @return false If company was NOT found
+     */
+    bool auditRange(const string &taxID,
+                    time_t from,
+                    time_t to,
+                    unsigned long long &sumIncome,
+                    size_t &count) const
+    {
+        CMethodScope scope(*this, M_AUDIT_RANGE, taxID);
+        idIterator iter;
+
+        // Search for company
+        if (!searchCompanyById(taxID, iter))
+            return false;
+
+        uint64_t sum = 0;
+        count = 0;
+
+        auto timeline = m_timelines.find(*iter);
+        if (timeline != m_timelines.end())
+            timeline->second.query(from, to, sum, count);
+
+        sumIncome = sum;
+
+        scope.hit();
+        return true;
+    }
+
+    /**
+     * @brief Get info about first added company
+     *
+     * @param[out] name Name of the first company
+     * @param[out] addr Address of the first company
+     * @return true If at least 1 company exists
+     * @return false If there are no companis yet
+     */
+    bool firstCompany(string &name,
+                      string &addr) const
+    {
+        static const string key;
+        CMethodScope scope(*this, M_FIRST_COMPANY, key);
+        CCompanyCursor cursor = companies();
+
+        if (!cursor.valid())
+            return false;
+
+        name = cursor.name();
+        addr = cursor.address();
+
+        scope.hit();
+        return true;
+    }
+
+    /**
+     * @brief Get next following company after company searched by name and address (case-insensitive)
+     *
+     * @param[in,out] name Name of the company to search for, is set to next company's name afterwards
+     * @param[in,out] addr Address of the company to search for, is set to next company's address afterwards
+     * @return true If company was found and next company exists
+     * @return false If company was NOT found, or there is NO next company present
+     */
+    bool nextCompany(string &name,
+                     string &addr) const
+    {
+        CCompanyCursor cursor = companies();
+
+        {
+            // Metrics are recorded before name and address are overwritten, as they are the key of the call
+            CMethodScope scope(*this, M_NEXT_COMPANY, name, &addr);
+            idIterator iter;
+
+            // Search for company
+            if (!searchCompanyByName(name, addr, iter))
+                return false;
+
+            // Move to the following company, skipping cancelled ones
+            cursor = CCompanyCursor(*this, iter - m_companiesByName.begin());
+            cursor.next();
+
+            // If next company doesn't exist
+            if (!cursor.valid())
+                return false;
+
+            scope.hit();
+        }
+
+        name = cursor.name();
+        addr = cursor.address();
+
+        return true;
+    }
+
+    /**
+     * @brief Get cursor pointing to the first company in alphabetical order
+     *
+     * @return CCompanyCursor Cursor, not valid if there are no companies
+     */
+    CCompanyCursor companies(void) const
+    {
+        return CCompanyCursor(*this, 0);
+    }
+
+    /**
+     * @brief Call visitor for every company in alphabetical order, without copying any strings
+     *
+     * @param[in] visitor Callable as visitor(name, address, taxId, invoicesSum)
+     */
+    template <typename TVisitor>
+    void forEachCompany(TVisitor visitor) const
+    {
+        for (uint32_t id : m_companiesByName)
+            if (!m_cancelled[id])
+                visitor(nameOf(id), addressOf(id), taxIdOf(id), m_invoicesSums[id]);
+    }
+
+    /**
+     * @brief Get companies whose name starts with prefix (case-insensitive), in alphabetical order
+     *
+     * @param[in] prefix Prefix of the company name, empty prefix matches all companies
+     * @param[in] limit Maximal count of companies to return
+     * @return vector<pair<string, string>> Names and addresses of found companies
+     */
+    vector<pair<string, string>> companiesWithPrefix(const string &prefix, size_t limit) const
+    {
+        CMethodScope scope(*this, M_COMPANIES_WITH_PREFIX, prefix);
+        vector<pair<string, string>> result;
+
+        // Find the first company with name not lower than prefix, all matching names follow it
+        auto iter = lower_bound(m_companiesByName.begin(), m_companiesByName.end(), prefix,
+                                [this](uint32_t id, const string &prefix)
+                                { return strcasecmp(nameOf(id), prefix.c_str()) < 0; });
+
+        CCompanyCursor cursor(*this, iter - m_companiesByName.begin());
+
+        for (; cursor.valid() && result.size() < limit; cursor.next())
+        {
+            if (strncasecmp(cursor.name(), prefix.c_str(), prefix.size()) != 0)
+                break;
+
+            result.emplace_back(cursor.name(), cursor.address());
+        }
+
+        if (!result.empty())
+            scope.hit();
+
+        return result;
+    }
+
+    /**
+     * @brief Get companies with the highest sum of invoices, O(k) as the order is maintained by every invoice
+     *
+     * @param[in] k Maximal count of companies to return
+     * @return vector<TCompanyTotal> Companies sorted by invoices sum (highest first), ties by name and address
+     */
+    vector<TCompanyTotal> topCompanies(size_t k) const
+    {
+        static const string key;
+        CMethodScope scope(*this, M_TOP_COMPANIES, key);
+        vector<TCompanyTotal> result;
+        result.reserve(min(k, m_companiesByTotal.size()));
+
+        for (auto iter = m_companiesByTotal.begin(); iter != m_companiesByTotal.end() && result.size() < k; iter++)
+            result.push_back({nameOf(*iter), addressOf(*iter), taxIdOf(*iter), m_invoicesSums[*iter]});
+
+        if (!result.empty())
+            scope.hit();
+
+        return result;
+    }
+
+    /**
+     * @brief Remove all cancelled companies at once, O(n), only runs when called
+     *
+     * Mutations only remove tombstones from the indexes, a few entries at a time. This also renumbers
+     * live companies in name order and copies their strings to a new string pool, so cancelled
+     * companies don't take any memory afterwards.
+     */
+    void compact(void)
+    {
+        const uint32_t removed = UINT32_MAX;
+
+        stopCompaction();
+
+        CVATRegister compacted;
+        vector<uint32_t> newIds(m_poolOffsets.size(), removed);
+
+        compacted.m_pool.reserve(m_pool.size());
+        for (uint32_t id : m_companiesByName)
+        {
+            if (m_cancelled[id])
+                continue;
+
+            newIds[id] = compacted.addCompany(nameOf(id), m_nameLengths[id],
+                                              addressOf(id), m_addressLengths[id],
+                                              taxIdOf(id), strlen(taxIdOf(id)));
+            compacted.m_invoicesSums[newIds[id]] = m_invoicesSums[id];
+            compacted.m_companiesByName.push_back(newIds[id]);
+        }
+
+        for (uint32_t id : m_companiesById)
+            if (newIds[id] != removed)
+                compacted.m_companiesById.push_back(newIds[id]);
+
+        m_pool.swap(compacted.m_pool);
+        m_poolOffsets.swap(compacted.m_poolOffsets);
+        m_nameLengths.swap(compacted.m_nameLengths);
+        m_addressLengths.swap(compacted.m_addressLengths);
+        m_invoicesSums.swap(compacted.m_invoicesSums);
+        m_cancelled.swap(compacted.m_cancelled);
+        m_companiesByName.swap(compacted.m_companiesByName);
+        m_companiesById.swap(compacted.m_companiesById);
+
+        // Rebuild the order by total with the new IDs
+        m_companiesByTotal.clear();
+        for (uint32_t id : m_companiesByName)
+            m_companiesByTotal.insert(id);
+
+        // Cancelled companies' timelines are already gone, only move the rest to new IDs
+        unordered_map<uint32_t, TInvoiceTimeline> timelines;
+        for (auto &timeline : m_timelines)
+            timelines.emplace(newIds[timeline.first], move(timeline.second));
+        m_timelines.swap(timelines);
+
+        m_nameTombstones = 0;
+        m_idTombstones = 0;
+    }
+
+    /**
+     * @brief Get median of all added invoices
+     *
+     * @return unsigned int Median of all added invoices, return 0 if there are no invoices yet
+     */
+    unsigned int medianInvoice(void) const
+    {
+        static const string key;
+        CMethodScope scope(*this, M_MEDIAN_INVOICE, key);
+        size_t size = invoicesCount();
+
+        // Can't find median if there are no invoices
+        if (size == 0)
+            return 0u;
+
+        scope.hit();
+
+        // Get the middle, the only element if there is just one
+        unsigned int amount = 0u;
+        kthAmount(size / (size_t)2, amount);
+
+        return amount;
+    }
+
+    /**
+     * @brief Get k-th smallest of all added invoices, invoices are kept sorted so this is a single lookup
+     *
+     * In approximate mode the amount is estimated from the histogram.
+     *
+     * @param[in] k Zero-based order of the invoice
+     * @param[out] amount Amount of the k-th smallest invoice
+     * @return true If there are more than k invoices
+     * @return false If there are k or less invoices
+     */
+    bool kthInvoice(size_t k, unsigned int &amount) const
+    {
+        static const string key;
+        CMethodScope scope(*this, M_KTH_INVOICE, key);
+
+        if (!kthAmount(k, amount))
+            return false;
+
+        scope.hit();
+        return true;
+    }
+
+    /**
+     * @brief Get quantile of all added invoices, quantileInvoice(0.5) is the same as medianInvoice()
+     *
+     * @param[in] p Quantile in range [0, 1], values out of range are clamped
+     * @return unsigned int Invoice at the p-th quantile, return 0 if there are no invoices yet or p is NaN
+     */
+    unsigned int quantileInvoice(double p) const
+    {
+        static const string key;
+        CMethodScope scope(*this, M_QUANTILE_INVOICE, key);
+        size_t size = invoicesCount();
+
+        // NaN can't be clamped, every comparison with it is false and the cast to size_t would be UB
+        if (size == 0 || isnan(p))
+            return 0u;
+
+        p = min(max(p, 0.0), 1.0);
+
+        unsigned int amount = 0u;
+        kthAmount(min((size_t)(p * size), size - 1), amount);
+
+        scope.hit();
+        return amount;
+    }
+
+    /**
+     * @brief Check if the register only keeps approximate histogram of invoices
+     *
+     * @return true If median and quantiles are approximate
+     * @return false If all invoice amounts are stored
+     */
+    bool isApproximate(void) const
+    {
+        return m_histogram != nullptr;
+    }
+
+    /**
+     * @brief Check if the register stores invoice amounts (exactly or in the histogram)
+     *
+     * @return true If median and quantiles are available
+     * @return false If register was created with NO_AMOUNTS
+     */
+    bool storesAmounts(void) const
+    {
+        return m_storeAmounts;
+    }
+
+    /**
+     * @brief Start measuring duration of every method call, counts of calls are collected always
+     *
+     * @param[in] slowestCount Count of the slowest calls to keep with their keys, 0 to keep none
+     */
+    void enableTiming(size_t slowestCount = 0)
+    {
+        m_timingEnabled = true;
+        m_slowestLimit = slowestCount;
+
+        lock_guard<mutex> lock(m_slowestMutex);
+        while (m_metrics.m_slowest.size() > m_slowestLimit)
+        {
+            pop_heap(m_metrics.m_slowest.begin(), m_metrics.m_slowest.end(), slowerThan);
+            m_metrics.m_slowest.pop_back();
+        }
+    }
+
+    /**
+     * @brief Stop measuring duration of method calls, already collected metrics are kept
+     */
+    void disableTiming(void)
+    {
+        m_timingEnabled = false;
+    }
+
+    /**
+     * @brief Set all counters to zero and forget the slowest calls
+     */
+    void resetMetrics(void)
+    {
+        for (TMethodCounters &counters : m_methodCounters)
+        {
+            counters.m_calls = 0;
+            counters.m_hits = 0;
+            counters.m_misses = 0;
+            counters.m_nanoseconds = 0;
+        }
+
+        lock_guard<mutex> lock(m_slowestMutex);
+        m_metrics = TMetrics();
+    }
+
+    /**
+     * @brief Get collected metrics
+     *
+     * @return TMetrics Counters of every method and the slowest calls, sorted from the slowest
+     */
+    TMetrics metrics(void) const
+    {
+        TMetrics result;
+        {
+            lock_guard<mutex> lock(m_slowestMutex);
+            result = m_metrics;
+        }
+
+        for (int method = 0; method < METHODS_COUNT; method++)
+        {
+            const TMethodCounters &counters = m_methodCounters[method];
+            result.m_methods[method] = {counters.m_calls.load(memory_order_relaxed),
+                                        counters.m_hits.load(memory_order_relaxed),
+                                        counters.m_misses.load(memory_order_relaxed),
+                                        counters.m_nanoseconds.load(memory_order_relaxed)};
+        }
+
+        sort(result.m_slowest.begin(), result.m_slowest.end(), slowerThan);
+
+        return result;
+    }
+
+    /**
+     * @brief Write collected metrics in Prometheus text exposition format
+     *
+     * @param[out] os Stream to write to
+     */
+    void writeMetrics(ostream &os) const
+    {
+        TMetrics collected = metrics();
+
+        static const array<pair<const char *, uint64_t TMethodMetrics::*>, 3> counters = {{
+            {"calls", &TMethodMetrics::m_calls},
+            {"hits", &TMethodMetrics::m_hits},
+            {"misses", &TMethodMetrics::m_misses},
+        }};
+
+        for (const auto &counter : counters)
+        {
+            os << "# TYPE vat_register_" << counter.first << "_total counter\n";
+            for (int method = 0; method < METHODS_COUNT; method++)
+                os << "vat_register_" << counter.first << "_total{method=\"" << methodName((EMethod)method) << "\"} "
+                   << collected.m_methods[method].*counter.second << '\n';
+        }
+
+        // Prometheus expects seconds, they are printed from integer nanoseconds to keep the precision
+        auto writeSeconds = [&os](uint64_t nanoseconds)
+        {
+            os << nanoseconds / 1000000000u << '.' << setfill('0') << setw(9) << nanoseconds % 1000000000u
+               << setfill(' ') << '\n';
+        };
+
+        os << "# TYPE vat_register_duration_seconds_total counter\n";
+        for (int method = 0; method < METHODS_COUNT; method++)
+        {
+            os << "vat_register_duration_seconds_total{method=\"" << methodName((EMethod)method) << "\"} ";
+            writeSeconds(collected.m_methods[method].m_nanoseconds);
+        }
+
+        os << "# TYPE vat_register_replayed_records_total counter\n"
+           << "vat_register_replayed_records_total " << collected.m_replayedRecords << '\n';
+
+        if (collected.m_slowest.empty())
+            return;
+
+        os << "# TYPE vat_register_slow_operation_seconds gauge\n";
+        for (size_t rank = 0; rank < collected.m_slowest.size(); rank++)
+        {
+            const TSlowOperation &operation = collected.m_slowest[rank];
+            os << "vat_register_slow_operation_seconds{rank=\"" << rank + 1 << "\",method=\""
+               << methodName(operation.m_method) << "\",key=\"" << escapeLabel(operation.m_key) << "\"} ";
+            writeSeconds(operation.m_nanoseconds);
+        }
+    }
+
+    /**
+     * @brief Save all companies and invoices to binary snapshot file
+     *
+     * Snapshot is written to temporary file, synced and then renamed over the old one,
+     * so a crash leaves either the old or the new snapshot, never a broken one.
+     *
+     * @param[in] path Path to the snapshot file, is overwritten
+     * @return true If snapshot was saved and is durable
+     * @return false If file couldn't be written, the old snapshot is then kept
+     */
+    bool save(const string &path) const
+    {
+        vector<TSnapshotRecord> records;
+        vector<uint32_t> idOrder;
+        string pool;
+
+        records.reserve(m_companiesByName.size());
+        idOrder.reserve(m_companiesById.size());
+
+        // Build the records in name order, remember record index of every company for the taxId order
+        vector<uint32_t> recordIndexes(m_poolOffsets.size());
+
+        for (uint32_t id : m_companiesByName)
+        {
+            if (m_cancelled[id])
+                continue;
+
+            uint32_t taxIdLength = strlen(taxIdOf(id));
+
+            recordIndexes[id] = (uint32_t)records.size();
+            records.push_back({pool.size(),
+                               m_nameLengths[id],
+                               m_addressLengths[id],
+                               taxIdLength,
+                               m_invoicesSums[id]});
+            pool.append(nameOf(id), m_nameLengths[id]);
+            pool.append(addressOf(id), m_addressLengths[id]);
+            pool.append(taxIdOf(id), taxIdLength);
+        }
+
+        for (uint32_t id : m_companiesById)
+            if (!m_cancelled[id])
+                idOrder.push_back(recordIndexes[id]);
+
+        vector<TSnapshotTimedInvoice> timedInvoices;
+        for (uint32_t id : m_companiesByName)
+        {
+            auto timeline = m_timelines.find(id);
+            if (timeline == m_timelines.end())
+                continue;
+
+            uint32_t record = recordIndexes[id];
+            timeline->second.forEach([&timedInvoices, record](int64_t timestamp, unsigned int amount)
+                                     { timedInvoices.push_back({record, amount, timestamp}); });
+        }
+
+        TSnapshotHeader header;
+        memcpy(header.m_magic, SNAPSHOT_MAGIC, sizeof(header.m_magic));
+        header.m_version = SNAPSHOT_VERSION;
+        header.m_companiesCount = records.size();
+        header.m_invoicesCount = m_invoices.size();
+        header.m_poolSize = pool.size();
+        header.m_logSequence = m_logSequence;
+        header.m_relativeError = m_histogram ? m_histogram->m_relativeError : 0.0;
+        header.m_bucketsCount = m_histogram ? m_histogram->m_buckets.size() : 0;
+        header.m_timedInvoicesCount = timedInvoices.size();
+
+        string data;
+        data.append((const char *)&header, sizeof(header));
+        data.append((const char *)records.data(), records.size() * sizeof(TSnapshotRecord));
+        data.append((const char *)idOrder.data(), idOrder.size() * sizeof(uint32_t));
+        data.append(pool);
+        data.append((const char *)m_invoices.data(), m_invoices.size() * sizeof(unsigned int));
+
+        if (m_histogram)
+            data.append((const char *)m_histogram->m_buckets.data(), m_histogram->m_buckets.size() * sizeof(uint64_t));
+
+        data.append((const char *)timedInvoices.data(), timedInvoices.size() * sizeof(TSnapshotTimedInvoice));
+
+        return CDurableFile::replace(path, data);
+    }
+
+    /**
+     * @brief Replace all companies and invoices with the ones from binary snapshot file
+     *
+     * Both indexes and the invoices are stored already sorted, so they are imported without any sorting or parsing.
+     * Counts in the header are validated against the file size before anything is allocated, order of both
+     * indexes, of the invoices and of the timed invoices is validated in O(n) while importing.
+     * Snapshots written by older versions (1 to 4) are read too. Register created with NO_AMOUNTS
+     * keeps the mode and drops invoice amounts from the snapshot.
+     *
+     * @param[in] path Path to the snapshot file
+     * @return true If snapshot was loaded
+     * @return false If file couldn't be read or is not valid, register is left unchanged
+     */
+    bool load(const string &path)
+    {
+        // Counts in the file are not trusted, huge ones must not end with an exception from the allocation
+        try
+        {
+            return loadSnapshot(path);
+        }
+        catch (const bad_alloc &)
+        {
+            return false;
+        }
+        catch (const length_error &)
+        {
+            return false;
+        }
+    }
+
+    /**
+     * @brief Start appending every change to the operation log, the log is written and synced in background
+     *
+     * @param[in] path Path to the log file, new records are appended to it
+     * @return true If log was opened
+     * @return false If log file couldn't be opened
+     */
+    bool enableLog(const string &path)
+    {
+        auto log = make_unique<COperationLog>();
+        if (!log->open(path))
+            return false;
+
+        m_log = move(log);
+
+        return true;
+    }
+
+    /**
+     * @brief Write and sync all pending log records, stop logging
+     *
+     * @return true If all logged changes are durable
+     * @return false If log wasn't enabled or writing failed
+     */
+    bool disableLog(void)
+    {
+        if (!m_log)
+            return false;
+
+        bool result = m_log->flush();
+        m_log.reset();
+
+        return result;
+    }
+
+    /**
+     * @brief Wait until all changes made so far are durable in the operation log
+     *
+     * @return true If all logged changes are durable
+     * @return false If log isn't enabled or writing failed
+     */
+    bool syncLog(void)
+    {
+        return m_log && m_log->flush();
+    }
+
+    /**
+     * @brief Save snapshot and discard the operation log, which is no longer needed for recovery
+     *
+     * The log is only truncated after the new snapshot is durable: save() syncs the temporary file,
+     * renames it and syncs the directory. A crash at any point leaves either the old snapshot with
+     * the full log, or the new snapshot.
+     *
+     * @param[in] snapshotPath
+     * @return true If snapshot was saved and log truncated
+     * @return false If log isn't enabled, or snapshot or log couldn't be written
+     */
+    bool checkpoint(const string &snapshotPath)
+    {
+        if (!m_log || !m_log->flush() || !save(snapshotPath))
+            return false;
+
+        // Even if truncating fails, replay skips records already stored in the snapshot
+        return m_log->truncate();
+    }
+
+    /**
+     * @brief Restore the register from snapshot and replay changes from the log made after the snapshot
+     *
+     * Must be called before enableLog(). Missing snapshot or log file is treated as empty.
+     * Torn tail of the log left by a crash is cut off.
+     *
+     * @param[in] snapshotPath
+     * @param[in] logPath
+     * @return true If register was restored
+     * @return false If log is enabled, or snapshot or log couldn't be read
+     */
+    bool recover(const string &snapshotPath, const string &logPath)
+    {
+        if (m_log)
+            return false;
+
+        ifstream snapshot(snapshotPath, ios::binary);
+        if (snapshot.is_open())
+        {
+            snapshot.close();
+            if (!load(snapshotPath))
+                return false;
+        }
+
+        auto apply = [this](const COperationLog::TRecord &record)
+        {
+            // Skip operations that are already in the snapshot
+            if (record.m_sequence <= m_logSequence)
+                return;
+
+            switch (record.m_operation)
+            {
+            case COperationLog::NEW_COMPANY:
+                newCompany(record.m_name, record.m_address, record.m_taxId);
+                break;
+            case COperationLog::CANCEL_BY_NAME:
+                cancelCompany(record.m_name, record.m_address);
+                break;
+            case COperationLog::CANCEL_BY_ID:
+                cancelCompany(record.m_taxId);
+                break;
+            case COperationLog::INVOICE_BY_ID:
+                invoice(record.m_taxId, record.m_amount);
+                break;
+            case COperationLog::INVOICE_BY_NAME:
+                invoice(record.m_name, record.m_address, record.m_amount);
+                break;
+            case COperationLog::INVOICE_AT_BY_ID:
+                invoiceAt(record.m_taxId, record.m_amount, record.m_timestamp);
+                break;
+            }
+
+            m_logSequence = record.m_sequence;
+            m_metrics.m_replayedRecords++;
+        };
+
+        // Replayed operations are counted separately, not as calls of the methods
+        m_metricsSuspended = true;
+        uint64_t validSize = 0;
+        bool replayed = COperationLog::replay(logPath, apply, &validSize);
+        m_metricsSuspended = false;
+
+        if (!replayed)
+            return false;
+
+        // Records appended later must directly follow the last valid one, not the torn tail
+        return COperationLog::cutTornTail(logPath, validSize);
+    }
+};
+
+/**
+ * @brief Thread-safe register composed of CVATRegister shards
+ *
+ * Companies are distributed to shards by hash of their taxId, every shard is a CVATRegister with its own lock.
+ * The name index (lowercase name and address to taxId) is sharded too, by hash of the name and address.
+ * Locks are always taken in this order: name shard first, then company shards in index order.
+ *
+ * Invoices only take shared locks: invoices sums are atomic counters next to the shard's register, so invoices
+ * of companies in the same shard run in parallel. Order by sums is not maintained by invoices, topCompanies()
+ * computes it when called.
+ */
+class CConcurrentVATRegister
+{
+
+private:
+    struct TShard
+    {
+        mutable shared_mutex m_mutex;
+
+        // Median is kept by CConcurrentVATRegister for all shards together, the shard's register only
+        // keeps companies. Its sums stay zero, real ones are in m_sums.
+        CVATRegister m_register{CVATRegister::NO_AMOUNTS};
+
+        // Invoices sums indexed by company ID in m_register, added to under the shared lock. Deque doesn't move
+        // its elements when growing, so a new company's sum is appended (under the exclusive lock) without copying.
+        deque<atomic<unsigned int>> m_sums;
+    };
+
+    struct TNameShard
+    {
+        mutable shared_mutex m_mutex;
+        unordered_map<string, string> m_taxIds;
+    };
+
+    // Invoice amounts are first collected in buffers (one per thread slot) and merged into the median heaps on read
+    struct TInvoiceBuffer
+    {
+        mutex m_mutex;
+        vector<unsigned int> m_amounts;
+    };
+
+    static const size_t SHARDS_COUNT = 64;
+    static const size_t NAME_SHARDS_COUNT = 64;
+    static const size_t BUFFERS_COUNT = 32;
+
+    array<TShard, SHARDS_COUNT> m_shards;
+    array<TNameShard, NAME_SHARDS_COUNT> m_nameShards;
+
+    mutable array<TInvoiceBuffer, BUFFERS_COUNT> m_buffers;
+
+    // All invoices split to two heaps, max-heap of the lower half including the median and min-heap of the rest,
+    // so merging new amounts is O(log n) per amount and the median is the top of the lower half
+    mutable mutex m_invoicesMutex;
+    mutable vector<unsigned int> m_lowerInvoices;
+    mutable vector<unsigned int> m_upperInvoices;
+
+    /**
+     * @brief Key of the name index, name and address are compared case-insensitively
+     */
+    static string nameKey(const string &name, const string &address)
+    {
+        string key;
+        key.reserve(name.size() + address.size() + 1);
+
+        for (char c : name)
+            key.push_back((char)tolower((unsigned char)c));
+        key.push_back('\0');
+        for (char c : address)
+            key.push_back((char)tolower((unsigned char)c));
+
+        return key;
+    }
+
+    TShard &shardFor(const string &taxId)
+    {
+        return m_shards[hash<string>()(taxId) % SHARDS_COUNT];
+    }
+
+    const TShard &shardFor(const string &taxId) const
+    {
+        return m_shards[hash<string>()(taxId) % SHARDS_COUNT];
+    }
+
+    TNameShard &nameShardFor(const string &key)
+    {
+        return m_nameShards[hash<string>()(key) % NAME_SHARDS_COUNT];
+    }
+
+    const TNameShard &nameShardFor(const string &key) const
+    {
+        return m_nameShards[hash<string>()(key) % NAME_SHARDS_COUNT];
+    }
+
+    /**
+     * @brief Get buffer for the calling thread, so threads don't fight over one lock when adding invoices
+     *
+     * @return TInvoiceBuffer&
+     */
+    TInvoiceBuffer &bufferForThread()
+    {
+        static thread_local size_t index = hash<thread::id>()(this_thread::get_id()) % BUFFERS_COUNT;
+        return m_buffers[index];
+    }
+
+    /**
+     * @brief Store invoice amount into the calling thread's buffer
+     *
+     * @param[in] amount
+     */
+    void addInvoiceAmount(unsigned int amount)
+    {
+        TInvoiceBuffer &buffer = bufferForThread();
+        lock_guard<mutex> lock(buffer.m_mutex);
+        buffer.m_amounts.push_back(amount);
+    }
+
+    /**
+     * @brief Find taxId of company by name and address, the name shard must be locked by caller
+     *
+     * @param[in] names
+     * @param[in] key Key from nameKey()
+     * @param[out] taxId
+     * @return true If company was found
+     * @return false If company was NOT found
+     */
+    static bool searchTaxId(const TNameShard &names, const string &key, string &taxId)
+    {
+        auto iter = names.m_taxIds.find(key);
+        if (iter == names.m_taxIds.end())
+            return false;
+
+        taxId = iter->second;
+        return true;
+    }
+
+    /**
+     * @brief Read invoices sum of company in shard, the shard must be locked by caller (shared lock is enough)
+     *
+     * Private lookups of the register are used, so reads are not counted in the shard's metrics.
+     *
+     * @param[in] shard
+     * @param[in] taxId
+     * @param[out] sumIncome
+     * @return true If company was found
+     * @return false If company was NOT found
+     */
+    static bool readSum(const TShard &shard, const string &taxId, unsigned int &sumIncome)
+    {
+        CVATRegister::idIterator iter;
+        if (!shard.m_register.searchCompanyById(taxId, iter))
+            return false;
+
+        sumIncome = shard.m_sums[*iter];
+        return true;
+    }
+
+    /**
+     * @brief Add invoice to company, by taxID, takes only the shared lock of the company's shard
+     *
+     * Amount is stored for the median before it is added to the sum. Whoever sees the new sum (or the call
+     * returning true), sees the amount in medianInvoice() too.
+     *
+     * @param[in] taxId
+     * @param[in] amount
+     * @return true If amount was successfully added
+     * @return false If company wasn't found
+     */
+    bool addInvoice(const string &taxId, unsigned int amount)
+    {
+        TShard &shard = shardFor(taxId);
+        shared_lock<shared_mutex> shardLock(shard.m_mutex);
+
+        // Company can't be cancelled while the shared lock is held
+        CVATRegister::idIterator iter;
+        if (!shard.m_register.searchCompanyById(taxId, iter))
             return false;
-        }
-
-        result = iter;
 
-        // Decrement the shared_ptr usage counter
-        searchCompany.reset();
+        addInvoiceAmount(amount);
+        shard.m_sums[*iter] += amount;
 
         return true;
     }
 
     /**
-     * @brief Search for company by taxId
-     *
-     * @param[in] taxId
-     * @param[out] result ptrIterator to the found company
-     * @return true If company was found
-     * @return false If company was NOT found
+     * @brief Compare companies case-insensitively by name and then by address
      */
-    bool searchCompanyById(const string &taxId, ptrIterator<TCompany> &result) const
+    static bool companyLess(const char *name, const char *address, const char *otherName, const char *otherAddress)
     {
-        // Companies vector is empty, can't search
-        if (m_companiesById.empty())
-            return false;
+        int namesCompare = strcasecmp(name, otherName);
 
-        // Create dummy company for compare function
-        auto searchCompany = make_shared<TCompany>("", "", taxId);
+        if (namesCompare == 0)
+            return strcasecmp(address, otherAddress) < 0;
 
-        // Search for the existing company
-        auto iter = lower_bound(m_companiesById.begin(), m_companiesById.end(), searchCompany, idComp);
+        return namesCompare < 0;
+    }
 
-        // If company doesn't exist
-        if (iter == m_companiesById.end())
-        {
-            // Decrement the shared_ptr usage counter
-            searchCompany.reset();
-            return false;
-        }
+    /**
+     * @brief Find the alphabetically first company over all shards that is after the given name and address
+     *
+     * All shards must be locked by caller.
+     *
+     * @param[in] name Empty pointer to find the very first company
+     * @param[in] address
+     * @param[out] nextName
+     * @param[out] nextAddress
+     * @return true If such company exists
+     * @return false If there is no company after the given one
+     */
+    bool findNext(const string *name, const string *address, string &nextName, string &nextAddress) const
+    {
+        const char *bestName = nullptr;
+        const char *bestAddress = nullptr;
 
-        // Check values are same
-        if (taxId != (*iter)->m_taxId)
+        for (const TShard &shard : m_shards)
         {
-            // Decrement the shared_ptr usage counter
-            searchCompany.reset();
-            return false;
+            const CVATRegister &reg = shard.m_register;
+            CVATRegister::CCompanyCursor cursor = reg.companies();
+
+            if (name)
+            {
+                cursor = CVATRegister::CCompanyCursor(reg, reg.lowerBoundByName(*name, *address) - reg.m_companiesByName.begin());
+                while (cursor.valid() && strcasecmp(cursor.name(), name->c_str()) == 0 && strcasecmp(cursor.address(), address->c_str()) == 0)
+                    cursor.next();
+            }
+
+            if (cursor.valid() && (!bestName || companyLess(cursor.name(), cursor.address(), bestName, bestAddress)))
+            {
+                bestName = cursor.name();
+                bestAddress = cursor.address();
+            }
         }
 
-        result = iter;
+        if (!bestName)
+            return false;
 
-        // Decrement the shared_ptr usage counter
-        searchCompany.reset();
+        nextName = bestName;
+        nextAddress = bestAddress;
 
         return true;
     }
 
+    /**
+     * @brief Lock all company shards for reading, in index order
+     */
+    vector<shared_lock<shared_mutex>> lockAllShards(void) const
+    {
+        vector<shared_lock<shared_mutex>> locks;
+        locks.reserve(SHARDS_COUNT);
+
+        for (const TShard &shard : m_shards)
+            locks.emplace_back(shard.m_mutex);
+
+        return locks;
+    }
+
 public:
-    CVATRegister(void) = default;
+    CConcurrentVATRegister(void) = default;
 
-    ~CVATRegister(void) = default;
+    ~CConcurrentVATRegister(void) = default;
 
     /**
      * @brief Create a new company if it doesn't exist yet
@@ -195,52 +3056,26 @@ public:
                     const string &addr,
                     const string &taxID)
     {
-        auto company = make_shared<TCompany>(name, addr, taxID);
-
-        // If vectors are empty, push_back new company
-        if (m_companiesByName.empty() && m_companiesById.empty())
-        {
-
-            m_companiesByName.push_back(company);
-            m_companiesById.push_back(company);
-
-            return true;
-        }
-
-        // Else find out the correct position where to insert
-        auto nameIter = lower_bound(m_companiesByName.begin(), m_companiesByName.end(), company, nameComp);
-        auto idIter = lower_bound(m_companiesById.begin(), m_companiesById.end(), company, idComp);
-
-        // If we found a position, check the company doesn't exist yet
-        if (nameIter != m_companiesByName.end() || idIter != m_companiesById.end())
-        {
+        string key = nameKey(name, addr);
+        TNameShard &names = nameShardFor(key);
+        TShard &shard = shardFor(taxID);
 
-            // If we found by name+addr, check that the taxId matches
-            if (idIter != m_companiesById.end() && (*idIter)->m_taxId == company->m_taxId)
-            {
-                // Decrement the usage counter, we're not be using this pointer anymore
-                company.reset();
-                return false;
-            }
+        unique_lock<shared_mutex> namesLock(names.m_mutex);
+        if (names.m_taxIds.count(key))
+            return false;
 
-            // If we found by ID, check the name+addr match
-            if (nameIter != m_companiesByName.end() &&
-                strcasecmp((*nameIter)->m_name.c_str(), company->m_name.c_str()) == 0 &&
-                strcasecmp((*nameIter)->m_address.c_str(), company->m_address.c_str()) == 0)
+        unique_lock<shared_mutex> shardLock(shard.m_mutex);
 
-            {
-                // Decrement the usage counter, we're not be using this pointer anymore
-                company.reset();
-                return false;
-            }
-        }
+        // Shard checks that the taxId is unique, the name is unique thanks to the name index
+        if (!shard.m_register.newCompany(name, addr, taxID))
+            return false;
 
-        // Else insert the newly made company
-        m_companiesByName.insert(nameIter, company);
-        m_companiesById.insert(idIter, company);
+        // Register gives IDs in order and shards are never compact()-ed, so the new company's ID is the new index
+        shard.m_sums.emplace_back(0u);
+        names.m_taxIds.emplace(move(key), taxID);
 
         return true;
-    };
+    }
 
     /**
      * @brief Delete company from database, by name and address (case-insensitive)
@@ -253,19 +3088,22 @@ public:
     bool cancelCompany(const string &name,
                        const string &addr)
     {
-        ptrIterator<TCompany> iterName;
-        ptrIterator<TCompany> iterId;
+        string key = nameKey(name, addr);
+        TNameShard &names = nameShardFor(key);
 
-        // Search for company in both vectors
-        if (!searchCompanyByName(name, addr, iterName))
+        unique_lock<shared_mutex> namesLock(names.m_mutex);
+
+        auto iter = names.m_taxIds.find(key);
+        if (iter == names.m_taxIds.end())
             return false;
 
-        if (!searchCompanyById((*iterName)->m_taxId, iterId))
+        TShard &shard = shardFor(iter->second);
+        unique_lock<shared_mutex> shardLock(shard.m_mutex);
+
+        if (!shard.m_register.cancelCompany(iter->second))
             return false;
 
-        // Erase from vectors
-        m_companiesByName.erase(iterName);
-        m_companiesById.erase(iterId);
+        names.m_taxIds.erase(iter);
 
         return true;
     }
@@ -273,32 +3111,50 @@ public:
     /**
      * @brief Delete company from database, by taxID
      *
+     * Name of the company is read from its shard first, as the name shard must be locked before the company shard.
+     * If the company changed in between, it's looked up again.
+     *
      * @param[in] taxID
-     * @param[in] addr
      * @return true If company was successfully deleted
      * @return false If company wasn't found
      */
     bool cancelCompany(const string &taxID)
     {
-        ptrIterator<TCompany> iterId;
-        ptrIterator<TCompany> iterName;
+        TShard &shard = shardFor(taxID);
 
-        // Search for company in both vectors
-        if (!searchCompanyById(taxID, iterId))
-            return false;
+        while (true)
+        {
+            string key;
+            {
+                shared_lock<shared_mutex> shardLock(shard.m_mutex);
 
-        if (!searchCompanyByName((*iterId)->m_name, (*iterId)->m_address, iterName))
-            return false;
+                CVATRegister::idIterator iter;
+                if (!shard.m_register.searchCompanyById(taxID, iter))
+                    return false;
 
-        // Erase from vectors
-        m_companiesByName.erase(iterName);
-        m_companiesById.erase(iterId);
+                key = nameKey(shard.m_register.nameOf(*iter), shard.m_register.addressOf(*iter));
+            }
 
-        return true;
+            TNameShard &names = nameShardFor(key);
+            unique_lock<shared_mutex> namesLock(names.m_mutex);
+
+            auto iter = names.m_taxIds.find(key);
+            if (iter == names.m_taxIds.end() || iter->second != taxID)
+                continue;
+
+            unique_lock<shared_mutex> shardLock(shard.m_mutex);
+
+            if (!shard.m_register.cancelCompany(taxID))
+                return false;
+
+            names.m_taxIds.erase(iter);
+
+            return true;
+        }
     }
 
     /**
-     * @brief Add a new invoice for company, by taxID
+     * @brief Add a new invoice for company, by taxID, takes only shared lock of one shard
      *
      * @param[in] taxID
      * @param[in] amount Amount of money to add
@@ -308,24 +3164,12 @@ public:
     bool invoice(const string &taxID,
                  unsigned int amount)
     {
-        ptrIterator<TCompany> iter;
-
-        // Search for company
-        if (!searchCompanyById(taxID, iter))
-            return false;
-
-        // Add amount to found company
-        (*iter)->m_invoicesSum += amount;
-
-        // Add amount to invocies vector
-        auto invoiceIter = lower_bound(m_invoices.begin(), m_invoices.end(), amount);
-        m_invoices.insert(invoiceIter, amount);
-
-        return true;
+        return addInvoice(taxID, amount);
     }
 
     /**
-     * @brief Add a new invoice for company, by name and address (case-insensitive)
+     * @brief Add a new invoice for company, by name and address (case-insensitive), takes only shared locks
+     * of one name shard and one shard
      *
      * @param[in] name
      * @param[in] addr
@@ -337,20 +3181,15 @@ public:
                  const string &addr,
                  unsigned int amount)
     {
-        ptrIterator<TCompany> iter;
+        string key = nameKey(name, addr);
+        const TNameShard &names = nameShardFor(key);
+        shared_lock<shared_mutex> namesLock(names.m_mutex);
 
-        // Search for company
-        if (!searchCompanyByName(name, addr, iter))
+        string taxId;
+        if (!searchTaxId(names, key, taxId))
             return false;
 
-        // Add amount to found company
-        (*iter)->m_invoicesSum += amount;
-
-        // Add amount to invocies vector
-        auto invoiceIter = lower_bound(m_invoices.begin(), m_invoices.end(), amount);
-        m_invoices.insert(invoiceIter, amount);
-
-        return true;
+        return addInvoice(taxId, amount);
     }
 
     /**
@@ -366,15 +3205,18 @@ public:
                const string &addr,
                unsigned int &sumIncome) const
     {
-        ptrIterator<TCompany> iter;
+        string key = nameKey(name, addr);
+        const TNameShard &names = nameShardFor(key);
+        shared_lock<shared_mutex> namesLock(names.m_mutex);
 
-        // Search for company
-        if (!searchCompanyByName(name, addr, iter))
+        string taxId;
+        if (!searchTaxId(names, key, taxId))
             return false;
 
-        sumIncome = (*iter)->m_invoicesSum;
+        const TShard &shard = shardFor(taxId);
+        shared_lock<shared_mutex> shardLock(shard.m_mutex);
 
-        return true;
+        return readSum(shard, taxId, sumIncome);
     }
 
     /**
@@ -388,19 +3230,14 @@ public:
     bool audit(const string &taxID,
                unsigned int &sumIncome) const
     {
-        ptrIterator<TCompany> iter;
-
-        // Search for company
-        if (!searchCompanyById(taxID, iter))
-            return false;
+        const TShard &shard = shardFor(taxID);
+        shared_lock<shared_mutex> shardLock(shard.m_mutex);
 
-        sumIncome = (*iter)->m_invoicesSum;
-
-        return true;
+        return readSum(shard, taxID, sumIncome);
     }
 
     /**
-     * @brief Get info about first added company
+     * @brief Get info about first company in alphabetical order, merges first companies of all shards
      *
      * @param[out] name Name of the first company
      * @param[out] addr Address of the first company
@@ -410,13 +3247,9 @@ public:
     bool firstCompany(string &name,
                       string &addr) const
     {
-        if (m_companiesByName.empty())
-            return false;
+        auto locks = lockAllShards();
 
-        name = m_companiesByName[0]->m_name;
-        addr = m_companiesByName[0]->m_address;
-
-        return true;
+        return findNext(nullptr, nullptr, name, addr);
     }
 
     /**
@@ -430,47 +3263,144 @@ public:
     bool nextCompany(string &name,
                      string &addr) const
     {
-        ptrIterator<TCompany> iter;
+        string key = nameKey(name, addr);
+        const TNameShard &names = nameShardFor(key);
+        shared_lock<shared_mutex> namesLock(names.m_mutex);
 
-        // Search for company
-        if (!searchCompanyByName(name, addr, iter))
+        if (!names.m_taxIds.count(key))
             return false;
 
-        // If next company doesn't exist
-        if ((iter + 1) == m_companiesByName.end())
+        auto locks = lockAllShards();
+
+        string nextName, nextAddress;
+        if (!findNext(&name, &addr, nextName, nextAddress))
             return false;
 
-        name = (*(iter + 1))->m_name;
-        addr = (*(iter + 1))->m_address;
+        name = nextName;
+        addr = nextAddress;
 
         return true;
     }
 
     /**
-     * @brief Get median of all added invoices
+     * @brief Get companies with the highest sum of invoices, merges the top k companies of every shard
+     *
+     * Invoices don't keep companies ordered by sum, so the top k of every shard are selected here from the
+     * current sums, in O(n log k). Invoices may still run meanwhile, each sum is read once.
+     *
+     * @param[in] k Maximal count of companies to return
+     * @return vector<CVATRegister::TCompanyTotal> Companies sorted by invoices sum (highest first), ties by name and address
+     */
+    vector<CVATRegister::TCompanyTotal> topCompanies(size_t k) const
+    {
+        vector<CVATRegister::TCompanyTotal> result;
+        auto locks = lockAllShards();
+
+        for (const TShard &shard : m_shards)
+        {
+            const CVATRegister &reg = shard.m_register;
+
+            // Sum and position in the name index, so ties are ordered by name without comparing strings
+            vector<pair<unsigned int, size_t>> totals;
+            for (size_t position = 0; position < reg.m_companiesByName.size(); position++)
+            {
+                uint32_t id = reg.m_companiesByName[position];
+                if (!reg.m_cancelled[id])
+                    totals.emplace_back(shard.m_sums[id], position);
+            }
+
+            auto higherTotal = [](const pair<unsigned int, size_t> &a, const pair<unsigned int, size_t> &b)
+            {
+                return a.first != b.first ? a.first > b.first : a.second < b.second;
+            };
+
+            size_t taken = min(k, totals.size());
+            partial_sort(totals.begin(), totals.begin() + taken, totals.end(), higherTotal);
+
+            for (size_t i = 0; i < taken; i++)
+            {
+                uint32_t id = reg.m_companiesByName[totals[i].second];
+                result.push_back({reg.nameOf(id), reg.addressOf(id), reg.taxIdOf(id), totals[i].first});
+            }
+        }
+
+        auto totalLess = [](const CVATRegister::TCompanyTotal &a, const CVATRegister::TCompanyTotal &b)
+        {
+            if (a.m_invoicesSum != b.m_invoicesSum)
+                return a.m_invoicesSum > b.m_invoicesSum;
+
+            return companyLess(a.m_name.c_str(), a.m_address.c_str(), b.m_name.c_str(), b.m_address.c_str());
+        };
+
+        size_t count = min(k, result.size());
+        partial_sort(result.begin(), result.begin() + count, result.end(), totalLess);
+        result.resize(count);
+
+        return result;
+    }
+
+    /**
+     * @brief Get median of all added invoices, merges amounts added since the last call into the heaps first
      *
      * @return unsigned int Median of all added invoices, return 0 if there are no invoices yet
      */
     unsigned int medianInvoice(void) const
     {
-        size_t size = m_invoices.size();
+        lock_guard<mutex> invoicesLock(m_invoicesMutex);
 
-        // Can't find median if there are no invoices
+        // Drain all buffers, hold each buffer lock only for the swap
+        for (auto &buffer : m_buffers)
+        {
+            vector<unsigned int> drained;
+            {
+                lock_guard<mutex> lock(buffer.m_mutex);
+                drained.swap(buffer.m_amounts);
+            }
+
+            for (unsigned int amount : drained)
+            {
+                if (m_lowerInvoices.empty() || amount <= m_lowerInvoices.front())
+                {
+                    m_lowerInvoices.push_back(amount);
+                    push_heap(m_lowerInvoices.begin(), m_lowerInvoices.end());
+                }
+                else
+                {
+                    m_upperInvoices.push_back(amount);
+                    push_heap(m_upperInvoices.begin(), m_upperInvoices.end(), greater<unsigned int>());
+                }
+            }
+        }
+
+        // Median is the element at index size / 2 of sorted invoices, so lower half has size / 2 + 1 of them
+        size_t size = m_lowerInvoices.size() + m_upperInvoices.size();
         if (size == 0)
             return 0u;
 
-        // No point in finding the middle if thres only 1 element
-        if (size == 1)
-            return m_invoices[0];
+        size_t lowerSize = size / 2 + 1;
+
+        while (m_lowerInvoices.size() > lowerSize)
+        {
+            pop_heap(m_lowerInvoices.begin(), m_lowerInvoices.end());
+            m_upperInvoices.push_back(m_lowerInvoices.back());
+            push_heap(m_upperInvoices.begin(), m_upperInvoices.end(), greater<unsigned int>());
+            m_lowerInvoices.pop_back();
+        }
 
-        // Get the middle from vector
-        size_t middle = size / (size_t)2;
+        while (m_lowerInvoices.size() < lowerSize)
+        {
+            pop_heap(m_upperInvoices.begin(), m_upperInvoices.end(), greater<unsigned int>());
+            m_lowerInvoices.push_back(m_upperInvoices.back());
+            push_heap(m_lowerInvoices.begin(), m_lowerInvoices.end());
+            m_upperInvoices.pop_back();
+        }
 
-        return m_invoices[middle];
+        return m_lowerInvoices.front();
     }
 };
 
-#ifndef __PROGTEST__
+// Tests, left out when the register is built by progtest or included by the benchmark
+#if !defined(__PROGTEST__) && !defined(VAT_REGISTER_NO_MAIN)
 int main(void)
 {
     string name, addr;
@@ -507,6 +3437,17 @@ int main(void)
     assert(b1.nextCompany(name, addr) && name == "Dummy" && addr == "Thakurova");
     assert(!b1.nextCompany(name, addr));
 
+    string listed;
+    for (auto cursor = b1.companies(); cursor.valid(); cursor.next())
+        listed += string(cursor.name()) + "/" + cursor.address() + "/" + cursor.taxId() + "/" + to_string(cursor.invoicesSum()) + ";";
+    assert(listed == "ACME/Kolejni/666/666/666/8000;ACME/Thakurova/666/666/2000;Dummy/Thakurova/123456/4000;");
+    size_t visited = 0;
+    unsigned int visitedSum = 0;
+    b1.forEachCompany([&visited, &visitedSum](const string &, const string &, const string &, unsigned int sum)
+                      { visited++; visitedSum += sum; });
+    assert(visited == 3 && visitedSum == 14000);
+    assert(!CVATRegister().companies().valid());
+
     assert(b1.cancelCompany("ACME", "KoLeJnI"));
     assert(b1.medianInvoice() == 4000);
     assert(b1.cancelCompany("666/666"));
@@ -561,6 +3502,627 @@ int main(void)
     assert(b2.newCompany("ACME", "Kolejni", "abcdef"));
     assert(b2.cancelCompany("ACME", "Kolejni"));
     assert(!b2.cancelCompany("ACME", "Kolejni"));
+    assert(b2.newCompany("ACME", "Kolejni", "abcdef"));
+    assert(b2.audit("abcdef", sumIncome) && sumIncome == 0);
+    assert(b2.cancelCompany("abcdef"));
+    assert(b2.newCompany("ACME", "Kolejni", "xyz"));
+    assert(b2.newCompany("Other", "Kolejni", "abcdef"));
+    assert(b2.firstCompany(name, addr) && name == "ACME" && addr == "Kolejni");
+    assert(b2.nextCompany(name, addr) && name == "Dummy" && addr == "Kolejni");
+    assert(b2.cancelCompany("Dummy", "Thakurova"));
+    assert(b2.nextCompany(name, addr) && name == "Other" && addr == "Kolejni");
+    assert(!b2.nextCompany(name, addr));
+    b2.compact();
+    assert(b2.firstCompany(name, addr) && name == "ACME" && addr == "Kolejni");
+    assert(b2.audit("xyz", sumIncome) && sumIncome == 0);
+    assert(b2.audit("123456", sumIncome) && sumIncome == 0);
+    assert(!b2.audit("ABCDEF", sumIncome));
+
+    {
+        // Tombstones are removed a bounded part of the indexes per mutation, there is no O(n) pause
+        CVATRegister k0;
+        for (int i = 0; i < 20000; i++)
+            assert(k0.newCompany("Company " + to_string(i), "Street", to_string(i)));
+        for (int i = 0; i < 20000; i++)
+        {
+            if (i % 4 != 0)
+                assert(k0.cancelCompany(to_string(i)));
+            if (i % 10 == 0)
+                assert(k0.newCompany("New " + to_string(i), "Street", "N" + to_string(i)));
+        }
+        CVATRegister::TMetrics metrics = k0.metrics();
+        assert(metrics.m_compactions >= 1 && metrics.m_maxCompactionMoves <= 512);
+        assert(metrics.m_compactionMoves > 20000);
+        for (int i = 0; i < 20000; i++)
+        {
+            assert(k0.audit(to_string(i), sumIncome) == (i % 4 == 0));
+            assert(k0.audit("Company " + to_string(i), "Street", sumIncome) == (i % 4 == 0));
+            assert(k0.audit("N" + to_string(i), sumIncome) == (i % 10 == 0));
+        }
+        size_t companiesCount = 0;
+        string previous;
+        for (bool found = k0.firstCompany(name, addr); found; found = k0.nextCompany(name, addr))
+        {
+            assert(companiesCount == 0 || strcasecmp(previous.c_str(), name.c_str()) < 0);
+            previous = name;
+            companiesCount++;
+        }
+        assert(companiesCount == 5000 + 2000);
+    }
+    {
+        // TaxIds in reverse order of names, so compaction copies a company cancelled meanwhile into one
+        // index and skips it in the other
+        CVATRegister k1;
+        char taxId[16];
+        for (int i = 0; i < 4000; i++)
+        {
+            snprintf(taxId, sizeof(taxId), "%05d", 4000 - i);
+            assert(k1.newCompany("Company " + to_string(10000 + i), "Street", taxId));
+        }
+        for (int i = 0; i < 3990; i++)
+        {
+            snprintf(taxId, sizeof(taxId), "%05d", 4000 - i);
+            assert(k1.cancelCompany(taxId));
+        }
+        assert(k1.metrics().m_compactions >= 2);
+        for (int i = 0; i < 4000; i++)
+        {
+            snprintf(taxId, sizeof(taxId), "%05d", 4000 - i);
+            assert(k1.audit(taxId, sumIncome) == (i >= 3990));
+            assert(k1.audit("Company " + to_string(10000 + i), "Street", sumIncome) == (i >= 3990));
+        }
+        assert(k1.companiesWithPrefix("", 100).size() == 10);
+    }
+
+    CVATRegister b5;
+    for (int i = 0; i < 1000; i++)
+        assert(b5.newCompany("Company " + to_string(i), "Street", to_string(i)));
+    for (int i = 0; i < 1000; i += 2)
+        assert(b5.cancelCompany(to_string(i)));
+    for (int i = 0; i < 1000; i++)
+        assert(b5.audit(to_string(i), sumIncome) == (i % 2 == 1));
+    unsigned long long windowSum = 0;
+    size_t windowCount = 0;
+    assert(b5.invoiceAt("1", 100, 1000));
+    assert(b5.invoiceAt("1", 200, 2000));
+    assert(b5.invoiceAt("1", 400, 4000));
+    assert(b5.invoiceAt("1", 300, 3000));
+    assert(b5.invoiceAt("1", 50, 500));
+    assert(b5.invoice("1", 1000));
+    assert(!b5.invoiceAt("2", 100, 1000));
+    assert(b5.audit("1", sumIncome) && sumIncome == 2050);
+    assert(b5.auditRange("1", 1000, 3000, windowSum, windowCount) && windowSum == 600 && windowCount == 3);
+    assert(b5.auditRange("1", 0, 10000, windowSum, windowCount) && windowSum == 1050 && windowCount == 5);
+    assert(b5.auditRange("1", 4001, 10000, windowSum, windowCount) && windowSum == 0 && windowCount == 0);
+    assert(b5.auditRange("1", 3000, 1000, windowSum, windowCount) && windowSum == 0 && windowCount == 0);
+    assert(b5.auditRange("3", 0, 10000, windowSum, windowCount) && windowSum == 0 && windowCount == 0);
+    assert(!b5.auditRange("2", 0, 10000, windowSum, windowCount));
+    {
+        // Late invoices in random order against brute force sums
+        vector<pair<int64_t, unsigned int>> timed;
+        unsigned int seed = 1;
+        for (int i = 0; i < 2000; i++)
+        {
+            seed = seed * 1103515245u + 12345u;
+            timed.push_back({(int64_t)(seed >> 8) % 5000 - 2500, seed % 1000});
+            assert(b5.invoiceAt("3", timed.back().second, timed.back().first));
+        }
+        for (int64_t from = -3000; from <= 3000; from += 250)
+        {
+            int64_t to = from + (from + 3000) / 2;
+            unsigned long long expectedSum = 0;
+            size_t expectedCount = 0;
+            for (const auto &invoice : timed)
+                if (invoice.first >= from && invoice.first <= to)
+                {
+                    expectedSum += invoice.second;
+                    expectedCount++;
+                }
+            assert(b5.auditRange("3", from, to, windowSum, windowCount) && windowSum == expectedSum && windowCount == expectedCount);
+        }
+    }
+    assert(b5.save("vat_snapshot.bin"));
+    CVATRegister b6;
+    assert(b6.load("vat_snapshot.bin"));
+    assert(b6.auditRange("1", 500, 2000, windowSum, windowCount) && windowSum == 350 && windowCount == 3);
+    assert(b6.auditRange("3", -2500, 2500, windowSum, windowCount) && windowCount == 2000);
+    remove("vat_snapshot.bin");
+    auto found = b5.companiesWithPrefix("company 99", 100);
+    assert(found.size() == 6 && found[0].first == "Company 99" && found[1].first == "Company 991" && found[5].first == "Company 999");
+    assert(b5.companiesWithPrefix("COMPANY 1", 3).size() == 3);
+    assert(b5.companiesWithPrefix("Company 998", 10).empty());
+    assert(b5.companiesWithPrefix("Corp", 10).empty());
+    assert(b5.companiesWithPrefix("", 1000).size() == 500);
+    size_t liveCount = 0;
+    for (auto cursor = b5.companies(); cursor.valid(); cursor.next())
+        liveCount++;
+    assert(liveCount == 500);
+
+    CVATRegister b3;
+    assert(b3.newCompany("ACME", "Kolejni", "111"));
+    assert(b3.newCompany("Dummy", "Thakurova", "222"));
+    assert(b3.invoice("111", 500));
+    assert(b3.invoiceBatch({{"111", 100}, {"222", 900}, {"333", 50}, {"222", 300}, {"111", 700}}) == 4);
+    assert(b3.audit("111", sumIncome) && sumIncome == 1300);
+    assert(b3.audit("222", sumIncome) && sumIncome == 1200);
+    assert(b3.medianInvoice() == 500);
+    assert(b3.invoiceBatch({{"222", 1000}}) == 1);
+    assert(b3.medianInvoice() == 700);
+    assert(b3.invoiceBatch({}) == 0);
+    {
+        CVATRegister v0;
+        assert(v0.newCompany("ACME", "Kolejni", "111"));
+        pair<string, unsigned int> batchArray[] = {{"333", 1}, {"111", 100}, {"111", 1000}};
+        assert(v0.invoiceBatch(batchArray, 2) == 1);
+        assert(v0.invoiceBatch(batchArray + 2, 1) == 1);
+        assert(v0.invoiceBatch(batchArray, 0) == 0);
+        assert(v0.audit("111", sumIncome) && sumIncome == 1100);
+        assert(v0.medianInvoice() == 1000);
+    }
+    auto top = b3.topCompanies(5);
+    assert(top.size() == 2);
+    assert(top[0].m_name == "Dummy" && top[0].m_taxId == "222" && top[0].m_invoicesSum == 2200);
+    assert(top[1].m_name == "ACME" && top[1].m_address == "Kolejni" && top[1].m_invoicesSum == 1300);
+    assert(b3.medianInvoice() == 700);
+    assert(b3.kthInvoice(0, sumIncome) && sumIncome == 100);
+    assert(b3.kthInvoice(5, sumIncome) && sumIncome == 1000);
+    assert(!b3.kthInvoice(6, sumIncome));
+    assert(b3.quantileInvoice(0.5) == b3.medianInvoice());
+    assert(b3.quantileInvoice(0.0) == 100);
+    assert(b3.quantileInvoice(0.9) == 1000);
+    assert(b3.quantileInvoice(1.0) == 1000);
+    assert(b2.quantileInvoice(0.99) == 3000);
+    assert(CVATRegister().quantileInvoice(0.99) == 0);
+    assert(b3.quantileInvoice(NAN) == 0);
+    assert(b3.quantileInvoice(-1.0) == 100);
+    assert(b3.quantileInvoice(INFINITY) == 1000);
+
+    assert(b3.save("vat_snapshot.bin"));
+    CVATRegister b4;
+    assert(b4.newCompany("Other", "Other", "999"));
+    assert(b4.load("vat_snapshot.bin"));
+    assert(!b4.audit("999", sumIncome));
+    assert(b4.audit("111", sumIncome) && sumIncome == 1300);
+    assert(b4.audit("Dummy", "Thakurova", sumIncome) && sumIncome == 2200);
+    assert(b4.medianInvoice() == 700);
+    assert(b4.firstCompany(name, addr) && name == "ACME" && addr == "Kolejni");
+    assert(b4.nextCompany(name, addr) && name == "Dummy" && addr == "Thakurova");
+    assert(!b4.nextCompany(name, addr));
+    assert(b4.topCompanies(1).size() == 1 && b4.topCompanies(1)[0].m_taxId == "222");
+    assert(b4.newCompany("Third", "Street", "000"));
+    assert(!b4.newCompany("Fourth", "Street", "222"));
+    assert(!b4.load("no_such_snapshot.bin"));
+    assert(b4.audit("000", sumIncome) && sumIncome == 0);
+    {
+        ifstream ifs("vat_snapshot.bin", ios::binary);
+        string snapshot((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+        assert(snapshot.size() > 16 && !ifstream("vat_snapshot.bin.tmp").is_open());
+
+        // Huge company count in the header (offset 8) and a truncated file are both rejected without throwing
+        string corrupted = snapshot;
+        uint64_t hugeCount = 1ull << 60;
+        memcpy(&corrupted[8], &hugeCount, sizeof(hugeCount));
+        ofstream("vat_snapshot.bin", ios::binary | ios::trunc) << corrupted;
+        assert(!b4.load("vat_snapshot.bin"));
+        ofstream("vat_snapshot.bin", ios::binary | ios::trunc) << snapshot.substr(0, snapshot.size() - 1);
+        assert(!b4.load("vat_snapshot.bin"));
+        ofstream("vat_snapshot.bin", ios::binary | ios::trunc) << snapshot + "x";
+        assert(!b4.load("vat_snapshot.bin"));
+        assert(b4.audit("000", sumIncome) && sumIncome == 0);
+
+        // Corrupted sorted sections: header has 64 bytes, 2 records of 24 bytes, taxId order of 2 indexes,
+        // pool "ACMEKolejni111DummyThakurova222", 6 invoices at the end
+        auto flipped = [&snapshot](size_t offset, char value)
+        {
+            string result = snapshot;
+            result[offset] = value;
+            return result;
+        };
+        assert(snapshot.size() == 64 + 48 + 8 + 31 + 24);
+        for (const string &corruptedOrder : {flipped(112, 1), flipped(120, 'Z'), flipped(122, '\0'), flipped(152, 0x7F)})
+        {
+            ofstream("vat_snapshot.bin", ios::binary | ios::trunc) << corruptedOrder;
+            assert(!b4.load("vat_snapshot.bin"));
+        }
+        assert(b4.audit("000", sumIncome) && sumIncome == 0);
+
+        // Snapshots of older versions have shorter header and no sections added later
+        string version3 = snapshot.substr(0, 56) + snapshot.substr(64);
+        uint32_t version = 3;
+        memcpy(&version3[4], &version, sizeof(version));
+        ofstream("vat_snapshot.bin", ios::binary | ios::trunc) << version3;
+        assert(b4.load("vat_snapshot.bin"));
+        assert(b4.audit("Dummy", "Thakurova", sumIncome) && sumIncome == 2200);
+        assert(b4.medianInvoice() == 700 && !b4.audit("000", sumIncome));
+
+        string version1 = snapshot.substr(0, 32) + snapshot.substr(64);
+        version = 1;
+        memcpy(&version1[4], &version, sizeof(version));
+        ofstream("vat_snapshot.bin", ios::binary | ios::trunc) << version1;
+        CVATRegister b7;
+        assert(b7.load("vat_snapshot.bin"));
+        assert(b7.audit("111", sumIncome) && sumIncome == 1300);
+        assert(b7.medianInvoice() == 700);
+
+        version = 6;
+        memcpy(&version1[4], &version, sizeof(version));
+        ofstream("vat_snapshot.bin", ios::binary | ios::trunc) << version1;
+        assert(!b7.load("vat_snapshot.bin"));
+    }
+    remove("vat_snapshot.bin");
+
+    assert(b3.invoice("ACME", "Kolejni", 900));
+    assert(b3.topCompanies(1)[0].m_taxId == "111");
+    assert(b3.newCompany("Zero", "Street", "333"));
+    assert(b3.topCompanies(3).back().m_taxId == "333");
+    assert(b3.cancelCompany("333"));
+    assert(b3.topCompanies(3).size() == 2);
+    assert(b3.topCompanies(0).empty());
+
+    remove("vat_wal_snapshot.bin");
+    remove("vat_wal.log");
+    {
+        CVATRegister w0;
+        assert(w0.enableLog("vat_wal.log"));
+        assert(w0.newCompany("ACME", "Kolejni", "111"));
+        assert(w0.newCompany("Dummy", "Thakurova", "222"));
+        assert(w0.invoice("111", 100));
+        assert(w0.checkpoint("vat_wal_snapshot.bin"));
+        assert(w0.invoice("Dummy", "Thakurova", 300));
+        assert(w0.invoiceAt("222", 50, 1000));
+        assert(w0.invoiceBatch({{"111", 200}, {"333", 50}}) == 1);
+        assert(w0.newCompany("Third", "Street", "333"));
+        assert(w0.cancelCompany("ACME", "Kolejni"));
+        assert(w0.syncLog());
+    }
+    {
+        CVATRegister w1;
+        assert(w1.recover("vat_wal_snapshot.bin", "vat_wal.log"));
+        assert(!w1.audit("111", sumIncome));
+        assert(w1.audit("222", sumIncome) && sumIncome == 350);
+        assert(w1.audit("Third", "Street", sumIncome) && sumIncome == 0);
+        assert(w1.medianInvoice() == 200);
+        unsigned long long windowSum = 0;
+        size_t windowCount = 0;
+        assert(w1.auditRange("222", 0, 2000, windowSum, windowCount) && windowSum == 50 && windowCount == 1);
+        assert(w1.enableLog("vat_wal.log"));
+        assert(w1.invoice("333", 400));
+        assert(w1.disableLog());
+    }
+    {
+        CVATRegister w2;
+        assert(w2.recover("vat_wal_snapshot.bin", "vat_wal.log"));
+        assert(w2.audit("333", sumIncome) && sumIncome == 400);
+        assert(w2.medianInvoice() == 200);
+    }
+    remove("vat_wal_snapshot.bin");
+    remove("vat_wal.log");
+    {
+        CVATRegister w3;
+        assert(w3.enableLog("vat_wal.log"));
+        assert(w3.newCompany("ACME", "Kolejni", "1"));
+        assert(w3.newCompany("Dummy", "Thakurova", "2"));
+        assert(w3.invoice("1", 100));
+        assert(w3.disableLog());
+    }
+    {
+        // Crash in the middle of the last record, its tail must not stay in front of new records
+        ifstream ifs("vat_wal.log", ios::binary);
+        string log((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+        ifs.close();
+        ofstream("vat_wal.log", ios::binary | ios::trunc) << log.substr(0, log.size() - 5);
+
+        CVATRegister w4;
+        assert(w4.recover("vat_wal_snapshot.bin", "vat_wal.log"));
+        assert(w4.audit("1", sumIncome) && sumIncome == 0);
+        assert(w4.enableLog("vat_wal.log"));
+        assert(w4.invoice("2", 777));
+        assert(w4.newCompany("Third", "Street", "3"));
+        assert(w4.syncLog());
+    }
+    {
+        CVATRegister w5;
+        assert(w5.recover("vat_wal_snapshot.bin", "vat_wal.log"));
+        assert(w5.audit("2", sumIncome) && sumIncome == 777);
+        assert(w5.audit("Third", "Street", sumIncome) && sumIncome == 0);
+        assert(w5.audit("1", sumIncome) && sumIncome == 0);
+    }
+    {
+        // Flipped byte in a record fails its checksum, the record and everything after it is dropped
+        fstream log("vat_wal.log", ios::binary | ios::in | ios::out);
+        log.seekp(-3, ios::end);
+        log.put('X');
+        log.close();
+
+        CVATRegister w6;
+        assert(w6.recover("vat_wal_snapshot.bin", "vat_wal.log"));
+        assert(w6.audit("2", sumIncome) && sumIncome == 777);
+        assert(!w6.audit("3", sumIncome));
+
+        // File that is not a log is neither replayed nor appended to
+        ofstream("vat_wal.log", ios::binary | ios::trunc) << "not a log file";
+        CVATRegister w7;
+        assert(!w7.recover("vat_wal_snapshot.bin", "vat_wal.log"));
+        assert(!w7.enableLog("vat_wal.log"));
+    }
+    remove("vat_wal.log");
+
+    CVATRegister a0(0.01);
+    assert(a0.isApproximate() && !b0.isApproximate());
+    assert(a0.medianInvoice() == 0);
+    assert(a0.newCompany("ACME", "Kolejni", "111"));
+    assert(a0.invoice("111", 0));
+    assert(a0.medianInvoice() == 0);
+    for (unsigned int i = 1; i <= 1000; i++)
+        assert(a0.invoice("ACME", "Kolejni", i * 1000));
+    assert(a0.invoiceBatch({{"111", 4000000}, {"222", 1}}) == 1);
+    assert(a0.audit("111", sumIncome) && sumIncome == 500500000 + 4000000);
+    assert(a0.medianInvoice() >= 495000 && a0.medianInvoice() <= 505000);
+    assert(a0.quantileInvoice(0.99) >= 980100 && a0.quantileInvoice(0.99) <= 999900);
+    assert(a0.kthInvoice(0, sumIncome) && sumIncome == 0);
+    assert(a0.kthInvoice(1001, sumIncome) && sumIncome >= 3960000 && sumIncome <= 4040000);
+    assert(!a0.kthInvoice(1002, sumIncome));
+    unsigned int approxMedian = a0.medianInvoice();
+    assert(a0.save("vat_snapshot.bin"));
+    CVATRegister a1;
+    assert(a1.load("vat_snapshot.bin"));
+    assert(a1.isApproximate() && a1.medianInvoice() == approxMedian);
+    assert(b4.load("vat_snapshot.bin") && b4.isApproximate());
+    remove("vat_snapshot.bin");
+
+    CVATRegister n0(CVATRegister::NO_AMOUNTS);
+    assert(!n0.storesAmounts() && !n0.isApproximate() && b0.storesAmounts());
+    assert(n0.newCompany("ACME", "Kolejni", "111"));
+    assert(n0.invoice("111", 100) && n0.invoiceBatch({{"111", 200}}) == 1 && n0.invoiceAt("111", 300, 10));
+    assert(n0.audit("ACME", "Kolejni", sumIncome) && sumIncome == 600);
+    assert(n0.medianInvoice() == 0 && !n0.kthInvoice(0, sumIncome) && n0.quantileInvoice(0.5) == 0);
+    assert(b3.save("vat_snapshot.bin") && n0.load("vat_snapshot.bin"));
+    assert(!n0.storesAmounts() && n0.medianInvoice() == 0 && n0.audit("111", sumIncome) && sumIncome == 2200);
+    remove("vat_snapshot.bin");
+
+    for (double relativeError : {0.0, 1.0, 1.5, -0.01, (double)NAN})
+    {
+        bool thrown = false;
+        try
+        {
+            CVATRegister invalid(relativeError);
+        }
+        catch (const invalid_argument &)
+        {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+    assert(CVATRegister(0.999).isApproximate());
+    {
+        // Every reported amount is within the relative error, small amounts and bucket edges included
+        vector<pair<string, unsigned int>> dense;
+        for (unsigned int amount = 0; amount <= 20000; amount++)
+            dense.push_back({"111", amount});
+        for (unsigned int amount = 20001; amount <= 1000000; amount += 997)
+            dense.push_back({"111", amount});
+        for (unsigned int amount = UINT_MAX - 100; amount != 0; amount++)
+            dense.push_back({"111", amount});
+
+        for (double relativeError : {0.001, 0.01, 0.05, 0.3, 0.6, 0.9, 0.999})
+        {
+            CVATRegister a2(relativeError);
+            assert(a2.newCompany("ACME", "Kolejni", "111"));
+            assert(a2.invoiceBatch(dense) == dense.size());
+            for (size_t k = 0; k < dense.size(); k++)
+            {
+                unsigned int estimate = 0;
+                assert(a2.kthInvoice(k, estimate));
+                assert(fabs((double)estimate - dense[k].second) <= relativeError * dense[k].second);
+            }
+        }
+    }
+    {
+        // Snapshot of version 4 had buckets for the full relative error and no exact counts, bucket of amount
+        // a was ceil(log(a) / log(gamma)) + 1
+        CVATRegister a3(0.01);
+        assert(a3.newCompany("ACME", "Kolejni", "111") && a3.save("vat_snapshot.bin"));
+        ifstream ifs("vat_snapshot.bin", ios::binary);
+        string snapshot((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+        ifs.close();
+
+        double gamma = 1.01 / 0.99;
+        vector<uint64_t> buckets((size_t)ceil(log((double)UINT_MAX) / log(gamma)) + 2, 0);
+        buckets[0] = 1;
+        buckets[(size_t)ceil(log(1000.0) / log(gamma)) + 1] = 2;
+        uint64_t bucketsCount = buckets.size();
+        uint32_t version = 4;
+
+        // Header (64 bytes), one record (24), taxId order (4), pool "ACMEKolejni111" (14), then the histogram
+        string version4 = snapshot.substr(0, 64 + 24 + 4 + 14) + string((const char *)buckets.data(), buckets.size() * sizeof(uint64_t));
+        memcpy(&version4[4], &version, sizeof(version));
+        memcpy(&version4[48], &bucketsCount, sizeof(bucketsCount));
+        ofstream("vat_snapshot.bin", ios::binary | ios::trunc) << version4;
+        assert(a3.load("vat_snapshot.bin"));
+        assert(a3.kthInvoice(0, sumIncome) && sumIncome == 0);
+        assert(a3.medianInvoice() >= 990 && a3.medianInvoice() <= 1010 && !a3.kthInvoice(3, sumIncome));
+        remove("vat_snapshot.bin");
+    }
+
+    CVATRegister m0;
+    assert(m0.newCompany("ACME", "Kolejni", "111"));
+    assert(!m0.newCompany("acme", "KOLEJNI", "222"));
+    assert(m0.invoice("111", 100) && !m0.invoice("222", 100));
+    assert(m0.metrics().m_methods[CVATRegister::M_NEW_COMPANY].m_calls == 2);
+    assert(m0.metrics().m_methods[CVATRegister::M_INVOICE].m_hits == 1);
+    assert(m0.metrics().m_methods[CVATRegister::M_INVOICE].m_misses == 1);
+    assert(m0.metrics().m_methods[CVATRegister::M_INVOICE].m_nanoseconds == 0);
+    m0.enableTiming(2);
+    assert(m0.audit("ACME", "Kolejni", sumIncome) && sumIncome == 100);
+    assert(!m0.audit("333", sumIncome));
+    assert(m0.invoice("111", 200));
+    CVATRegister::TMetrics metrics = m0.metrics();
+    assert(metrics.m_methods[CVATRegister::M_AUDIT].m_calls == 2 && metrics.m_methods[CVATRegister::M_AUDIT].m_hits == 1);
+    assert(metrics.m_slowest.size() == 2 && metrics.m_slowest[0].m_nanoseconds >= metrics.m_slowest[1].m_nanoseconds);
+    ostringstream prometheus;
+    m0.writeMetrics(prometheus);
+    assert(prometheus.str().find("vat_register_calls_total{method=\"invoice\"} 3\n") != string::npos);
+    assert(prometheus.str().find("vat_register_misses_total{method=\"newCompany\"} 1\n") != string::npos);
+    assert(prometheus.str().find("vat_register_slow_operation_seconds{rank=\"2\"") != string::npos);
+    m0.resetMetrics();
+    assert(m0.metrics().m_methods[CVATRegister::M_INVOICE].m_calls == 0 && m0.metrics().m_slowest.empty());
+    assert(m0.medianInvoice() == 200 && m0.quantileInvoice(0.0) == 100 && m0.kthInvoice(1, sumIncome));
+    assert(!m0.kthInvoice(2, sumIncome) && m0.quantileInvoice(NAN) == 0);
+    assert(m0.firstCompany(name, addr) && m0.topCompanies(1).size() == 1 && m0.companiesWithPrefix("X", 1).empty());
+    metrics = m0.metrics();
+    assert(metrics.m_methods[CVATRegister::M_MEDIAN_INVOICE].m_hits == 1);
+    assert(metrics.m_methods[CVATRegister::M_KTH_INVOICE].m_calls == 2 && metrics.m_methods[CVATRegister::M_KTH_INVOICE].m_misses == 1);
+    assert(metrics.m_methods[CVATRegister::M_QUANTILE_INVOICE].m_calls == 2 && metrics.m_methods[CVATRegister::M_QUANTILE_INVOICE].m_hits == 1);
+    assert(metrics.m_methods[CVATRegister::M_FIRST_COMPANY].m_hits == 1 && metrics.m_methods[CVATRegister::M_TOP_COMPANIES].m_hits == 1);
+    assert(metrics.m_methods[CVATRegister::M_COMPANIES_WITH_PREFIX].m_misses == 1);
+    {
+        // Operations replayed by recover() are counted apart from the calls
+        CVATRegister m1;
+        assert(m1.enableLog("vat_wal.log"));
+        assert(m1.newCompany("ACME", "Kolejni", "111") && m1.invoice("111", 100));
+        assert(m1.disableLog());
+        CVATRegister m2;
+        assert(m2.recover("vat_wal_snapshot.bin", "vat_wal.log"));
+        assert(m2.metrics().m_replayedRecords == 2);
+        assert(m2.metrics().m_methods[CVATRegister::M_NEW_COMPANY].m_calls == 0 && m2.metrics().m_methods[CVATRegister::M_INVOICE].m_calls == 0);
+        assert(m2.audit("111", sumIncome) && sumIncome == 100);
+        assert(m2.metrics().m_methods[CVATRegister::M_AUDIT].m_calls == 1);
+        ostringstream replayed;
+        m2.writeMetrics(replayed);
+        assert(replayed.str().find("vat_register_replayed_records_total 2\n") != string::npos);
+        remove("vat_wal.log");
+    }
+
+    {
+        // Const methods only touch atomic counters and the mutex guarded slowest calls, readers may run in parallel
+        CVATRegister m3;
+        assert(m3.newCompany("ACME", "Kolejni", "111") && m3.invoice("111", 100));
+        m3.enableTiming(4);
+        vector<thread> readers;
+        for (int t = 0; t < 4; t++)
+            readers.emplace_back([&m3]()
+                                 {
+                                     unsigned int sum = 0;
+                                     for (int i = 0; i < 1000; i++)
+                                         assert(m3.audit("111", sum) && sum == 100 && m3.medianInvoice() == 100);
+                                 });
+        for (auto &t : readers)
+            t.join();
+        CVATRegister::TMetrics metrics = m3.metrics();
+        assert(metrics.m_methods[CVATRegister::M_AUDIT].m_hits == 4000 && metrics.m_methods[CVATRegister::M_MEDIAN_INVOICE].m_calls == 4000);
+        assert(metrics.m_slowest.size() == 4);
+    }
+
+    CConcurrentVATRegister c0;
+    assert(c0.newCompany("ACME", "Thakurova", "666/666"));
+    assert(c0.newCompany("ACME", "Kolejni", "666/666/666"));
+    assert(c0.newCompany("Dummy", "Thakurova", "123456"));
+    assert(!c0.newCompany("acme", "KOLEJNI", "999"));
+    assert(!c0.newCompany("Other", "Other", "123456"));
+    assert(c0.medianInvoice() == 0);
+    assert(c0.invoice("666/666", 2000));
+    assert(c0.invoice("666/666/666", 3000));
+    assert(c0.invoice("123456", 4000));
+    assert(c0.invoice("aCmE", "Kolejni", 5000));
+    assert(!c0.invoice("1234567", 100));
+    assert(c0.medianInvoice() == 4000);
+    assert(c0.audit("ACME", "Kolejni", sumIncome) && sumIncome == 8000);
+    assert(c0.audit("123456", sumIncome) && sumIncome == 4000);
+    assert(c0.firstCompany(name, addr) && name == "ACME" && addr == "Kolejni");
+    assert(c0.nextCompany(name, addr) && name == "ACME" && addr == "Thakurova");
+    assert(c0.nextCompany(name, addr) && name == "Dummy" && addr == "Thakurova");
+    assert(!c0.nextCompany(name, addr));
+    assert(c0.cancelCompany("ACME", "KoLeJnI"));
+    assert(!c0.audit("666/666/666", sumIncome));
+    assert(c0.cancelCompany("666/666"));
+    assert(!c0.cancelCompany("666/666"));
+    assert(c0.medianInvoice() == 4000);
+
+    vector<thread> threads;
+    for (int t = 0; t < 8; t++)
+        threads.emplace_back([&c0]()
+                             {
+                                 for (unsigned int i = 1; i <= 1000; i++)
+                                     assert(c0.invoice("123456", i));
+                             });
+    for (auto &t : threads)
+        t.join();
+    assert(c0.audit("Dummy", "Thakurova", sumIncome) && sumIncome == 4000 + 8 * 500500);
+    assert(c0.medianInvoice() == 501);
+    assert(c0.newCompany("Third", "Street", "777"));
+    assert(c0.invoice("777", 4000 + 8 * 500500) && c0.invoice("Third", "street", 1));
+    auto concurrentTop = c0.topCompanies(5);
+    assert(concurrentTop.size() == 2 && concurrentTop[0].m_taxId == "777" && concurrentTop[1].m_name == "Dummy");
+    assert(c0.topCompanies(1).size() == 1 && c0.topCompanies(0).empty());
+
+    {
+        // Threads register, invoice and cancel their own companies, cancel by name and by taxId race on shared ones
+        CConcurrentVATRegister c1;
+        vector<unsigned int> amounts[4];
+        atomic<int> created{0}, cancelled{0};
+        vector<thread> workers;
+        for (int t = 0; t < 4; t++)
+            workers.emplace_back([&c1, &amounts, &created, &cancelled, t]()
+                                 {
+                                     unsigned int sum = 0;
+                                     for (int i = 0; i < 500; i++)
+                                     {
+                                         string id = to_string(t) + "/" + to_string(i);
+                                         assert(c1.newCompany("Company " + id, "Street", id));
+                                         amounts[t].push_back((unsigned int)(i * 7919 % 1000));
+                                         assert(c1.invoice("COMPANY " + id, "street", amounts[t].back()));
+                                         assert(c1.audit(id, sum) && sum == amounts[t].back());
+                                         if (i % 2)
+                                             assert(c1.cancelCompany(id));
+                                         cancelled += c1.cancelCompany("Shared " + to_string(i), "Street");
+                                         cancelled += c1.cancelCompany("S" + to_string(i));
+                                         created += c1.newCompany("Shared " + to_string(i), "Street", "S" + to_string(i));
+                                     } });
+        for (auto &t : workers)
+            t.join();
+
+        vector<unsigned int> all;
+        for (auto &threadAmounts : amounts)
+            all.insert(all.end(), threadAmounts.begin(), threadAmounts.end());
+        sort(all.begin(), all.end());
+        assert(c1.medianInvoice() == all[all.size() / 2]);
+
+        // Shared company exists at the end only if it was created once more than cancelled
+        size_t sharedCount = 0, companiesCount = 0;
+        for (int i = 0; i < 500; i++)
+            sharedCount += c1.audit("S" + to_string(i), sumIncome);
+        for (bool found = c1.firstCompany(name, addr); found; found = c1.nextCompany(name, addr))
+            companiesCount++;
+        assert(created - cancelled == (int)sharedCount && companiesCount == 4 * 250 + sharedCount);
+    }
+    {
+        // Median read after the new sum is visible in another thread already counts the invoice
+        CConcurrentVATRegister c2;
+        assert(c2.newCompany("ACME", "Kolejni", "111"));
+        atomic<unsigned int> checked{0};
+        const unsigned int rounds = 300;
+        thread writer([&c2, &checked]()
+                      {
+                          for (unsigned int i = 1; i <= rounds; i++)
+                          {
+                              assert(c2.invoice("111", i));
+                              while (checked < i)
+                                  this_thread::yield();
+                          } });
+        thread reader([&c2, &checked]()
+                      {
+                          unsigned int sum = 0;
+                          for (unsigned int i = 1; i <= rounds; i++)
+                          {
+                              while (!c2.audit("ACME", "Kolejni", sum) || sum != i * (i + 1) / 2)
+                                  this_thread::yield();
+                              // Invoices are 1 .. i, median is the one at index i / 2
+                              assert(c2.medianInvoice() == i / 2 + 1);
+                              checked = i;
+                          } });
+        writer.join();
+        reader.join();
+    }
 
     return EXIT_SUCCESS;
 }
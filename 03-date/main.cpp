@@ -1,5 +1,6 @@
 #ifndef __PROGTEST__
 #include <cstdio>
+#include <cstring>
 #include <cstdlib>
 #include <ctime>
 #include <cassert>
@@ -8,6 +9,22 @@
 #include <string>
 #include <sstream>
 #include <stdexcept>
+#include <algorithm>
+#include <vector>
+#include <cstdint>
+#include <climits>
+#include <functional>
+#include <unordered_map>
+#include <map>
+#include <optional>
+#include <bitset>
+// <version> defines the library feature-test macros, <compare> is only included when the library has it
+#if __has_include(<version>)
+#include <version>
+#endif
+#if defined(__cpp_lib_three_way_comparison) && __cpp_lib_three_way_comparison >= 201907L
+#include <compare>
+#endif
 using namespace std;
 #endif /* __PROGTEST__ */
 
@@ -22,319 +39,660 @@ public:
     }
 };
 //=================================================================================================
-// date_format manipulator - a dummy implementation. Keep this code unless you implement your
-// own working manipulator.
-ios_base &(*date_format(const char *fmt))(ios_base &x)
+// Formatting of numbers without streams, two digits are copied at once from the lookup table
+static const char DIGIT_PAIRS[] = "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+                                  "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+// Write number padded by zeros to at least width digits, return pointer past the last written character
+static char *writePadded(char *out, int value, int width)
 {
-    return [](ios_base &ios) -> ios_base &
-    { return ios; };
+    if (width == 4 && value >= 0 && value <= 9999)
+    {
+        memcpy(out, DIGIT_PAIRS + 2 * (value / 100), 2);
+        memcpy(out + 2, DIGIT_PAIRS + 2 * (value % 100), 2);
+        return out + 4;
+    }
+
+    if (width == 2 && value >= 0 && value <= 99)
+    {
+        memcpy(out, DIGIT_PAIRS + 2 * value, 2);
+        return out + 2;
+    }
+
+    // Slow path for values out of range of the width
+    unsigned int absolute = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+    char digits[10];
+    int count = 0;
+
+    do
+    {
+        digits[count++] = (char)('0' + absolute % 10);
+        absolute /= 10;
+    } while (absolute);
+
+    if (value < 0)
+        *out++ = '-';
+    for (int i = count; i < width; i++)
+        *out++ = '0';
+    while (count)
+        *out++ = digits[--count];
+
+    return out;
 }
 //=================================================================================================
-class CDate
+// date_format manipulator - format string is compiled once to a list of instructions, which is
+// stored in the stream (pword) and then used by every CDate read from or written to the stream.
+class CDateFormat
 {
-private:
-    int m_year;
-    int m_month;
-    int m_day;
-
 public:
-    static bool isLeapYear(int year)
+    enum EInstruction
     {
-        return (year % 4 == 0 && ((year % 100 != 0 || year % 400 == 0) && year % 4000 != 0));
-    }
+        LITERAL,
+        YEAR,
+        MONTH,
+        DAY
+    };
 
-    static int getDaysInMonth(int year, int month)
+    struct TInstruction
     {
-        if (month == 2 && isLeapYear(year))
-            return 29;
+        EInstruction m_type;
+        // Text to match or print, only for LITERAL
+        string m_literal;
+    };
 
-        int months[] = {31,
-                        28,
-                        31,
-                        30,
-                        31,
-                        30,
-                        31,
-                        31,
-                        30,
-                        31,
-                        30,
-                        31};
-
-        return months[month - 1];
+private:
+    vector<TInstruction> m_program;
+    // Format can be parsed only if it contains each of year, month and day exactly once
+    bool m_parsable = false;
+    // Format is %Y-%m-%d, dates are then written by the faster formatDate()
+    bool m_iso = false;
+
+    // Index of the stream's pword (the format) and iword (callback is registered)
+    static int streamIndex()
+    {
+        static const int index = ios_base::xalloc();
+        return index;
     }
 
-    static bool isValidDate(int year, int month, int day)
+    // Streams own their copy of the format, it's deleted with the stream and cloned by copyfmt()
+    static void streamCallback(ios_base::event event, ios_base &ios, int index)
     {
-        if (month < 1 || month > 12)
-            return false;
+        void *&format = ios.pword(index);
 
-        if (day < 0 || day > getDaysInMonth(year, month))
-            return false;
+        if (event == ios_base::erase_event)
+        {
+            delete (CDateFormat *)format;
+            format = nullptr;
+        }
+        else if (event == ios_base::copyfmt_event && format)
+            format = new CDateFormat(*(CDateFormat *)format);
+    }
 
-        return true;
+    static const CDateFormat &isoFormat()
+    {
+        static const CDateFormat format("%Y-%m-%d");
+        return format;
     }
 
-    static int countDaysDifference(const CDate &dateA, const CDate &dateB)
+public:
+    explicit CDateFormat(const char *format)
     {
-        long long daysDiff = 0;
+        int fieldsCount[4] = {};
 
-        if (dateA.m_year != dateB.m_year)
+        for (const char *c = format; *c; c++)
         {
-            // Remaining days to the end of the year
-            daysDiff = (isLeapYear(dateA.m_year) ? 366 : 365) - dateA.countDaysFromBeggining();
+            EInstruction type = LITERAL;
 
-            for (int i = dateA.m_year + 1; i < dateB.m_year; i++)
-                daysDiff += isLeapYear(i) ? 366 : 365;
+            if (*c == '%')
+            {
+                switch (c[1])
+                {
+                case 'Y':
+                    type = YEAR;
+                    break;
+                case 'm':
+                    type = MONTH;
+                    break;
+                case 'd':
+                    type = DAY;
+                    break;
+                case '%':
+                    c++;
+                    break;
+                }
+            }
 
-            daysDiff += dateB.countDaysFromBeggining();
-        }
-        else
-        {
-            daysDiff = dateB.countDaysFromBeggining() - dateA.countDaysFromBeggining();
+            if (type != LITERAL)
+            {
+                m_program.push_back({type, ""});
+                fieldsCount[type]++;
+                c++;
+                continue;
+            }
+
+            // Join following characters into one literal
+            if (m_program.empty() || m_program.back().m_type != LITERAL)
+                m_program.push_back({LITERAL, ""});
+            m_program.back().m_literal.push_back(*c);
         }
 
-        return daysDiff;
+        m_parsable = fieldsCount[YEAR] == 1 && fieldsCount[MONTH] == 1 && fieldsCount[DAY] == 1;
+        m_iso = m_program.size() == 5 && m_parsable &&
+                m_program[0].m_type == YEAR && m_program[1].m_literal == "-" &&
+                m_program[2].m_type == MONTH && m_program[3].m_literal == "-" && m_program[4].m_type == DAY;
     }
 
-    int countDaysFromBeggining() const
+    const vector<TInstruction> &program() const
     {
-        int result = 0;
-
-        result += m_day;
+        return m_program;
+    }
 
-        for (int i = 1; i < m_month; i++)
-        {
-            result += getDaysInMonth(m_year, i);
-        }
+    bool parsable() const
+    {
+        return m_parsable;
+    }
 
-        return result;
+    bool iso() const
+    {
+        return m_iso;
     }
 
-    void addYears(int years)
+    // Get format set to the stream, ISO format (%Y-%m-%d) if none was set
+    static const CDateFormat &get(ios_base &ios)
     {
-        m_year += years;
+        void *format = ios.pword(streamIndex());
+        return format ? *(const CDateFormat *)format : isoFormat();
     }
 
-    void addMonths(int months)
+    // Store copy of the format to the stream, replacing the previous one
+    void apply(ios_base &ios) const
     {
-        // For adding positive value, possible overflow to next year
-        if (m_month + months > 12)
+        long &registered = ios.iword(streamIndex());
+        if (!registered)
         {
-            int years = (months > 12) ? months / 12 : 1;
-            addYears(years);
-            m_month = (m_month + months - 12 * (years));
-            return;
+            ios.register_callback(streamCallback, streamIndex());
+            registered = 1;
         }
 
-        // For adding negative value, possible underflow to previous year
-        if (m_month + months < 1)
+        void *&format = ios.pword(streamIndex());
+        delete (CDateFormat *)format;
+        format = new CDateFormat(*this);
+    }
+
+    void print(ostream &output, int year, int month, int day) const
+    {
+        char buffer[16];
+
+        for (const TInstruction &instruction : m_program)
         {
-            int years = (abs(months) > 12) ? (abs(months) / 12) : 1;
-            addYears(-years);
-            m_month = (m_month + months + 12 * (years));
-            return;
+            switch (instruction.m_type)
+            {
+            case LITERAL:
+                output.write(instruction.m_literal.data(), instruction.m_literal.size());
+                break;
+            case YEAR:
+                output.write(buffer, writePadded(buffer, year, 4) - buffer);
+                break;
+            case MONTH:
+                output.write(buffer, writePadded(buffer, month, 2) - buffer);
+                break;
+            case DAY:
+                output.write(buffer, writePadded(buffer, day, 2) - buffer);
+                break;
+            }
         }
-
-        m_month += months;
     }
 
-    void addDays(int days)
+    // Read date in the format, year has to have exactly 4 digits, month and day exactly 2, literals must match exactly
+    bool parse(istream &input, int &year, int &month, int &day) const
     {
-        while (days > 0)
+        if (!m_parsable)
+            return false;
+
+        istream::sentry sentry(input);
+        if (!sentry)
+            return false;
+
+        for (const TInstruction &instruction : m_program)
         {
+            char c;
 
-            int daysInCurrentYear = isLeapYear(m_year) ? 366 : 365;
-            if (days >= daysInCurrentYear)
+            if (instruction.m_type == LITERAL)
             {
-                addYears(1);
-                days -= daysInCurrentYear;
+                for (char expected : instruction.m_literal)
+                    if (!input.get(c) || c != expected)
+                        return false;
                 continue;
             }
 
-            int daysInCurrentMonth = getDaysInMonth(m_year, m_month);
-            if (days >= daysInCurrentMonth)
+            int value = 0;
+            for (int digits = (instruction.m_type == YEAR) ? 4 : 2; digits > 0; digits--)
             {
-                addMonths(1);
-                days -= daysInCurrentMonth;
-                continue;
+                if (!input.get(c) || c < '0' || c > '9')
+                    return false;
+                value = value * 10 + (c - '0');
             }
 
-            m_day += days;
+            (instruction.m_type == YEAR ? year : instruction.m_type == MONTH ? month : day) = value;
+        }
 
-            if (m_day > getDaysInMonth(m_year, m_month))
-            {
-                m_day -= getDaysInMonth(m_year, m_month);
-                addMonths(1);
-            }
+        return true;
+    }
 
-            days = 0;
-        }
+    friend ostream &operator<<(ostream &output, const CDateFormat &format)
+    {
+        format.apply(output);
+        return output;
+    }
 
-        while (days < 0)
-        {
+    friend istream &operator>>(istream &input, const CDateFormat &format)
+    {
+        format.apply(input);
+        return input;
+    }
+};
 
-            int daysInCurrentYear = isLeapYear(m_year) ? 366 : 365;
-            if (abs(days) >= daysInCurrentYear)
-            {
-                addYears(-1);
-                days += daysInCurrentYear;
-                continue;
-            }
+CDateFormat date_format(const char *fmt)
+{
+    return CDateFormat(fmt);
+}
+//=================================================================================================
+// Lengths of months and days before each month, index 0 for common and 1 for leap years, built at compile time
+struct TMonthDays
+{
+    int m_daysInMonth[2][12];
+    int m_daysBefore[2][13];
 
-            if (abs(days) >= getDaysInMonth(m_year, m_month))
-            {
-                addMonths(-1);
-                days += getDaysInMonth(m_year, m_month);
-                continue;
-            }
+    constexpr TMonthDays()
+        : m_daysInMonth{{31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31},
+                        {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31}},
+          m_daysBefore{}
+    {
+        for (int leap = 0; leap < 2; leap++)
+            for (int month = 0; month < 12; month++)
+                m_daysBefore[leap][month + 1] = m_daysBefore[leap][month] + m_daysInMonth[leap][month];
+    }
+};
 
-            m_day += days;
+static constexpr TMonthDays MONTH_DAYS{};
+static_assert(MONTH_DAYS.m_daysBefore[0][12] == 365 && MONTH_DAYS.m_daysBefore[1][12] == 366, "Year has 365 or 366 days");
+//=================================================================================================
+class CDate
+{
+private:
+    // Days since 1970-01-01, negative before it, the only member so the date is packed to 4 bytes
+    int32_t m_days = 0;
+
+    // Calendar has Gregorian leap years except years divisible by 4000, so it repeats every 4000 years
+    static const int DAYS_IN_ERA = 4000 * 365 + 1000 - 40 + 10 - 1;
+    static const int DAYS_IN_400_YEARS = 400 * 365 + 100 - 4 + 1;
+    // Days from 0000-03-01 (start of era 0) to 1970-01-01
+    static const int EPOCH_OFFSET = 719468;
+
+    /**
+     * @brief Convert date to days since epoch in O(1)
+     *
+     * Years are counted from March, so the leap day is the last day of the year and
+     * each era of 4000 years starts on March 1st of a year divisible by 4000.
+     */
+    static constexpr int daysFromCivil(int year, int month, int day)
+    {
+        year -= month <= 2;
 
-            if (m_day < 1)
-            {
-                addMonths(-1);
-                m_day += getDaysInMonth(m_year, m_month);
-            }
+        const int era = (year >= 0 ? year : year - 3999) / 4000;
+        const int yearOfEra = year - era * 4000;
+        const int dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+        const int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + yearOfEra / 400 + dayOfYear;
 
-            days = 0;
-        }
+        return era * DAYS_IN_ERA + dayOfEra - EPOCH_OFFSET;
+    }
+
+    /**
+     * @brief Convert days since epoch to date in O(1), inverse to daysFromCivil()
+     */
+    static constexpr void civilFromDays(int days, int &year, int &month, int &day)
+    {
+        days += EPOCH_OFFSET;
+
+        const int era = (days >= 0 ? days : days - (DAYS_IN_ERA - 1)) / DAYS_IN_ERA;
+        const int dayOfEra = days - era * DAYS_IN_ERA;
+
+        // Era is 10 Gregorian cycles of 400 years, the last one is 1 day shorter (missing the leap day of year 4000)
+        const int cycle = min(dayOfEra / DAYS_IN_400_YEARS, 9);
+        const int dayOfCycle = dayOfEra - cycle * DAYS_IN_400_YEARS;
+        const int yearOfEra = cycle * 400 + (dayOfCycle - dayOfCycle / 1460 + dayOfCycle / 36524 - dayOfCycle / 146096) / 365;
+
+        const int dayOfYear = dayOfEra - (yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + yearOfEra / 400);
+        const int monthFromMarch = (5 * dayOfYear + 2) / 153;
+
+        day = dayOfYear - (153 * monthFromMarch + 2) / 5 + 1;
+        month = monthFromMarch < 10 ? monthFromMarch + 3 : monthFromMarch - 9;
+        year = yearOfEra + era * 4000 + (month <= 2);
     }
 
-    CDate() = default;
+    /**
+     * @brief Set date from year, month and day, day is clamped to the length of the month
+     *
+     * @throw InvalidDateException If the year is out of range of valid dates
+     */
+    constexpr void setClamped(long long year, int month, int day)
+    {
+        if (year < MIN_YEAR || year > MAX_YEAR)
+            throw InvalidDateException();
+
+        m_days = daysFromCivil((int)year, month, min(day, getDaysInMonth((int)year, month)));
+    }
 
-    CDate(int year, int month, int day)
+    /**
+     * @brief Parse YYYY-MM-DD from 10 characters, all 8 digits are checked and converted at once in one 64-bit word
+     *
+     * Checks are joined by & instead of &&, so invalid input doesn't cause any hard to predict branches.
+     */
+    static bool parseIso(const char *str, int &days)
+    {
+        static const unsigned char daysInMonth[16] = {0, 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31, 0, 0, 0};
+
+        // Digits YYYYMMDD, first digit in the lowest byte
+        uint64_t word = 0;
+        const int positions[8] = {0, 1, 2, 3, 5, 6, 8, 9};
+        for (int i = 0; i < 8; i++)
+            word |= (uint64_t)(unsigned char)str[positions[i]] << (8 * i);
+
+        // Every byte is in '0'..'9' if its high nibble is 3, and adding 6 doesn't carry to the high nibble
+        bool valid = ((word & 0xF0F0F0F0F0F0F0F0ull) | (((word + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull) >> 4)) ==
+                     0x3333333333333333ull;
+
+        // Join pairs of digits to 2-digit numbers in every other byte
+        word -= 0x3030303030303030ull;
+        word = (word * 10 + (word >> 8)) & 0x00FF00FF00FF00FFull;
+
+        int year = (int)(word & 0xFF) * 100 + (int)((word >> 16) & 0xFF);
+        int month = (int)((word >> 32) & 0xFF);
+        int day = (int)((word >> 48) & 0xFF);
+
+        int leapDay = (month == 2) & (year % 4 == 0) & ((year % 100 != 0) | (year % 400 == 0)) & (year % 4000 != 0);
+
+        valid &= (str[4] == '-') & (str[7] == '-') &
+                 ((unsigned)(month - 1) < 12u) &
+                 ((unsigned)(day - 1) < (unsigned)(daysInMonth[month & 15] + leapDay));
+
+        days = daysFromCivil(year, month, day);
+
+        return valid;
+    }
+
+public:
+    // Range of years of valid dates, day numbers of all of them and differences between any two of them
+    // fit to int32 without overflow
+    static const int MIN_YEAR = -2000000;
+    static const int MAX_YEAR = 2000000;
+
+    static constexpr bool isLeapYear(int year)
+    {
+        return (year % 4 == 0 && ((year % 100 != 0 || year % 400 == 0) && year % 4000 != 0));
+    }
+
+    static constexpr int getDaysInMonth(int year, int month)
+    {
+        return MONTH_DAYS.m_daysInMonth[isLeapYear(year)][month - 1];
+    }
+
+    static constexpr bool isValidDate(int year, int month, int day)
+    {
+        if (year < MIN_YEAR || year > MAX_YEAR)
+            return false;
+
+        if (month < 1 || month > 12)
+            return false;
+
+        if (day < 1 || day > getDaysInMonth(year, month))
+            return false;
+
+        return true;
+    }
+
+    static constexpr int countDaysDifference(const CDate &dateA, const CDate &dateB)
+    {
+        return dateB.m_days - dateA.m_days;
+    }
+
+    constexpr int year() const
+    {
+        int year = 0, month = 0, day = 0;
+        civilFromDays(m_days, year, month, day);
+        return year;
+    }
+
+    constexpr int month() const
+    {
+        int year = 0, month = 0, day = 0;
+        civilFromDays(m_days, year, month, day);
+        return month;
+    }
+
+    constexpr int day() const
+    {
+        int year = 0, month = 0, day = 0;
+        civilFromDays(m_days, year, month, day);
+        return day;
+    }
+
+    // Day of year, 1 for January 1st
+    constexpr int dayOfYear() const
+    {
+        int year = 0, month = 0, day = 0;
+        civilFromDays(m_days, year, month, day);
+
+        return MONTH_DAYS.m_daysBefore[isLeapYear(year)][month - 1] + day;
+    }
+
+    constexpr int countDaysFromBeggining() const
+    {
+        return dayOfYear();
+    }
+
+    // ISO day of week, 1 is Monday and 7 is Sunday (1970-01-01 was Thursday)
+    constexpr int dayOfWeek() const
+    {
+        return ((m_days + 3) % 7 + 7) % 7 + 1;
+    }
+
+    // ISO week number, 1 to 53, week belongs to the year of its Thursday, so it may be the previous or next year's week
+    constexpr int isoWeek() const
+    {
+        CDate thursday = fromDayNumber(m_days - dayOfWeek() + 4);
+        return (thursday.dayOfYear() - 1) / 7 + 1;
+    }
+
+    // Quarter of year, 1 to 4
+    constexpr int quarter() const
+    {
+        return (month() - 1) / 3 + 1;
+    }
+
+    // Day is clamped to the length of the month, e.g. 2000-02-29 + 1 year is 2001-02-28
+    constexpr void addYears(int years)
+    {
+        int year = 0, month = 0, day = 0;
+        civilFromDays(m_days, year, month, day);
+
+        setClamped((long long)year + years, month, day);
+    }
+
+    // Day is clamped to the length of the month, e.g. 2000-01-31 + 1 month is 2000-02-29
+    constexpr void addMonths(int months)
+    {
+        int year = 0, month = 0, day = 0;
+        civilFromDays(m_days, year, month, day);
+
+        // Months since year 0, floor division keeps the month positive
+        long long total = (long long)year * 12 + (month - 1) + months;
+        long long newYear = (total >= 0 ? total : total - 11) / 12;
+
+        setClamped(newYear, (int)(total - newYear * 12) + 1, day);
+    }
+
+    constexpr void addDays(int days)
+    {
+        m_days += days;
+    }
+
+    // Days since 1970-01-01, for storing dates in plain int32 columns
+    constexpr int32_t dayNumber() const
+    {
+        return m_days;
+    }
+
+    static constexpr CDate fromDayNumber(int32_t days)
+    {
+        CDate date;
+        date.m_days = days;
+        return date;
+    }
+
+    constexpr CDate() = default;
+
+    // Maximal length of date formatted by formatDate(), years out of 0-9999 have more than 4 digits
+    static const size_t MAX_FORMATTED_LENGTH = 16;
+
+    friend char *formatDate(char *out, const CDate &date);
+    friend size_t parseDates(const char *buf, size_t len, vector<CDate> &out, vector<size_t> &invalid);
+
+    constexpr CDate(int year, int month, int day)
     {
         if (!isValidDate(year, month, day))
             throw InvalidDateException();
 
-        m_year = year;
-        m_month = month;
-        m_day = day;
+        m_days = daysFromCivil(year, month, day);
+    }
+
+    // Create date without throwing, empty if the date is not valid
+    static constexpr optional<CDate> tryMake(int year, int month, int day)
+    {
+        if (!isValidDate(year, month, day))
+            return nullopt;
+
+        return fromDayNumber(daysFromCivil(year, month, day));
     }
 
-    // Output date as formatted string
+    // Output date as formatted string, in format set by date_format (ISO by default)
     friend ostream &operator<<(ostream &output, const CDate &date)
     {
-        output << std::setfill('0') << std::setw(4) << date.m_year << '-';
-        output << std::setfill('0') << std::setw(2) << date.m_month << '-';
-        output << std::setfill('0') << std::setw(2) << date.m_day;
+        const CDateFormat &format = CDateFormat::get(output);
+
+        if (format.iso())
+        {
+            char buffer[MAX_FORMATTED_LENGTH];
+            output.write(buffer, formatDate(buffer, date) - buffer);
+            return output;
+        }
+
+        int year, month, day;
+        civilFromDays(date.m_days, year, month, day);
+
+        format.print(output, year, month, day);
         return output;
     }
 
-    // Read input and parse to date
+    // Read input in format set by date_format (ISO by default) and parse to date, date is left unchanged on failure
     friend istream &operator>>(istream &input, CDate &date)
     {
-        char d0 = 0;
-        char d1 = 0;
         int year = 0;
         int month = 0;
         int day = 0;
-        CDate tmp;
-
-        if (!(input >> year >> d0 >> month >> d1 >> day))
-        {
-            input.setstate(ios::failbit);
-            cerr << "Bad input" << endl;
-            return input;
-        }
+        optional<CDate> parsed;
 
-        if (d0 != '-' ||
-            d1 != '-')
-        {
-            input.setstate(ios::failbit);
-            cerr << "Bad delimiter" << endl;
-            return input;
-        }
+        // Neither parsing nor validation throws or writes anything, bad input only sets failbit
+        if (CDateFormat::get(input).parse(input, year, month, day))
+            parsed = tryMake(year, month, day);
 
-        try
-        {
-            tmp = CDate(year, month, day);
-        }
-        catch (const exception &e)
+        if (!parsed)
         {
-            cerr << date << " | " << e.what() << endl;
             input.setstate(ios::failbit);
             return input;
         }
 
-        date = tmp;
+        date = *parsed;
         return input;
     }
 
-    bool operator==(const CDate &rhs) const
+    constexpr bool operator==(const CDate &rhs) const
     {
-        return (m_year == rhs.m_year &&
-                m_month == rhs.m_month &&
-                m_day == rhs.m_day);
+        return m_days == rhs.m_days;
     }
 
-    bool operator!=(const CDate &rhs) const
+    constexpr bool operator!=(const CDate &rhs) const
     {
-        return (m_year != rhs.m_year ||
-                m_month != rhs.m_month ||
-                m_day != rhs.m_day);
+        return m_days != rhs.m_days;
     }
 
-    bool operator>(const CDate &rhs) const
+#if defined(__cpp_lib_three_way_comparison) && __cpp_lib_three_way_comparison >= 201907L
+    // Single integer comparison, only when the library provides <compare> (C++20)
+    constexpr strong_ordering operator<=>(const CDate &rhs) const
     {
-        return countDaysDifference(rhs, *this) > 0;
+        return m_days <=> rhs.m_days;
     }
+#endif
 
-    bool operator<(const CDate &rhs) const
+    constexpr bool operator>(const CDate &rhs) const
     {
-        return countDaysDifference(rhs, *this) < 0;
+        return m_days > rhs.m_days;
     }
 
-    bool operator>=(const CDate &rhs) const
+    constexpr bool operator<(const CDate &rhs) const
     {
-        return countDaysDifference(rhs, *this) >= 0;
+        return m_days < rhs.m_days;
     }
 
-    bool operator<=(const CDate &rhs) const
+    constexpr bool operator>=(const CDate &rhs) const
     {
-        return countDaysDifference(rhs, *this) <= 0;
+        return m_days >= rhs.m_days;
+    }
+
+    constexpr bool operator<=(const CDate &rhs) const
+    {
+        return m_days <= rhs.m_days;
     }
 
     // date + num
-    CDate operator+(const int days) const
+    constexpr CDate operator+(const int days) const
     {
-        CDate ret(m_year, m_month, m_day);
+        CDate ret = *this;
         ret.addDays(days);
         return ret;
     }
 
     // date += num
-    CDate &operator+=(const int days)
+    constexpr CDate &operator+=(const int days)
     {
         *this = *this + days;
         return *this;
     }
 
     // date - num
-    CDate operator-(const int days) const
+    constexpr CDate operator-(const int days) const
     {
-        CDate ret(m_year, m_month, m_day);
+        CDate ret = *this;
         ret.addDays(-days);
         return ret;
     }
 
     // date -= num
-    CDate &operator-=(const int days)
+    constexpr CDate &operator-=(const int days)
     {
         *this = *this - days;
         return *this;
     }
 
     // Prefix ++
-    CDate &operator++()
+    constexpr CDate &operator++()
     {
         addDays(1);
         return *this;
     }
 
     // Postfix ++
-    CDate operator++(int)
+    constexpr CDate operator++(int)
     {
         CDate temp = *this;
         addDays(1);
@@ -342,14 +700,14 @@ public:
     }
 
     // Prefix --
-    CDate &operator--()
+    constexpr CDate &operator--()
     {
         addDays(-1);
         return *this;
     }
 
     // Postfix --
-    CDate operator--(int)
+    constexpr CDate operator--(int)
     {
         CDate temp = *this;
         addDays(-1);
@@ -357,9 +715,455 @@ public:
     }
 
     // Difference in days between two days
-    int operator-(const CDate &rhs) const
+    constexpr int operator-(const CDate &rhs) const
+    {
+        int difference = countDaysDifference(*this, rhs);
+        return difference < 0 ? -difference : difference;
+    }
+};
+
+/**
+ * @brief Difference in days of two columns of day numbers, out[i] = a[i] - b[i]
+ *
+ * Loop has no branches nor dependencies between iterations, so the compiler vectorizes it.
+ *
+ * @param[in] a Day numbers (CDate::dayNumber())
+ * @param[in] b Day numbers
+ * @param[in] count Count of items in a, b and out
+ * @param[out] out Differences
+ */
+void diffDays(const int32_t *a, const int32_t *b, size_t count, int32_t *out)
+{
+    for (size_t i = 0; i < count; i++)
+        out[i] = a[i] - b[i];
+}
+
+/**
+ * @brief Mark day numbers in range [lo, hi] in bitmap, bit i % 64 of word i / 64 is set for days[i]
+ *
+ * Range is checked by a single unsigned comparison producing one byte per day. Full blocks of 64 days
+ * use a loop with constant trip count, which GCC vectorizes already at -O2 (its cheap cost model skips
+ * loops that need an epilogue). The bytes are then packed to bits 8 at a time by one multiplication.
+ *
+ * @param[in] days Day numbers (CDate::dayNumber())
+ * @param[in] count Count of day numbers
+ * @param[in] lo First day number in range
+ * @param[in] hi Last day number in range
+ * @param[out] bitmap Space for (count + 63) / 64 words
+ * @return size_t Count of day numbers in range
+ */
+size_t filterRange(const int32_t *days, size_t count, int32_t lo, int32_t hi, uint64_t *bitmap)
+{
+    size_t matches = 0;
+    uint32_t width = (uint32_t)hi - (uint32_t)lo;
+
+    for (size_t word = 0; word * 64 < count; word++)
+    {
+        size_t end = min(count - word * 64, (size_t)64);
+        const int32_t *block = days + word * 64;
+        uint8_t flags[64] = {};
+
+        // Days before lo wrap around to large unsigned numbers, so they are out of range too
+        if (end == 64)
+            for (size_t i = 0; i < 64; i++)
+                flags[i] = (uint32_t)block[i] - (uint32_t)lo <= width;
+        else
+            for (size_t i = 0; i < end; i++)
+                flags[i] = (uint32_t)block[i] - (uint32_t)lo <= width;
+
+        uint64_t bits = 0;
+        for (int byte = 0; byte < 8; byte++)
+        {
+            // Assembled by shifts, so flag j always lands in byte j regardless of the byte order
+            uint64_t eightFlags = 0;
+            for (int j = 0; j < 8; j++)
+                eightFlags |= (uint64_t)flags[8 * byte + j] << (8 * j);
+
+            bits |= ((eightFlags * 0x0102040810204080ull) >> 56) << (8 * byte);
+        }
+
+        bitmap[word] = lo <= hi ? bits : 0;
+        matches += lo <= hi ? bitset<64>(bits).count() : 0;
+    }
+
+    return matches;
+}
+
+// Dates are hashed by their day number, so CDate can be a key of unordered containers
+namespace std
+{
+    template <>
+    struct hash<CDate>
+    {
+        size_t operator()(const CDate &date) const noexcept
+        {
+            return hash<int32_t>()(date.dayNumber());
+        }
+    };
+}
+
+static_assert(sizeof(CDate) == 4, "CDate is packed to 4 bytes");
+static_assert(is_trivially_copyable<CDate>::value, "CDate can be copied by memcpy");
+
+// Calendar invariants, checked by the compiler
+static_assert(CDate(1970, 1, 1) == CDate(), "Default date is the epoch");
+static_assert(CDate(2000, 2, 28) + 1 == CDate(2000, 2, 29), "Year 2000 is leap");
+static_assert(CDate(1900, 2, 28) + 1 == CDate(1900, 3, 1), "Year 1900 is not leap");
+static_assert(CDate(4000, 2, 28) + 1 == CDate(4000, 3, 1), "Year 4000 is not leap");
+static_assert(CDate(4001, 1, 1) - CDate(1, 1, 1) == 4000 * 365 + 1000 - 40 + 10 - 1, "Era has 1460969 days");
+static_assert(CDate(2024, 12, 31).countDaysFromBeggining() == 366, "Leap year has 366 days");
+static_assert(CDate(-1, 12, 31) + 1 == CDate(0, 1, 1), "Dates continue over year 0");
+static_assert(CDate(2000, 1, 1).dayOfWeek() == 6 && CDate(1969, 12, 29).dayOfWeek() == 1, "2000-01-01 was Saturday");
+static_assert(CDate(2024, 12, 30).isoWeek() == 1 && CDate(2021, 1, 3).isoWeek() == 53, "ISO week belongs to year of its Thursday");
+
+/**
+ * @brief Parse dates in YYYY-MM-DD format separated by newlines or commas, without any streams or exceptions
+ *
+ * Records may end with CR before the separator. Only valid dates are appended to out,
+ * indexes of invalid records (counted from 0, including the invalid ones) are appended to invalid.
+ *
+ * @param[in] buf Buffer with dates
+ * @param[in] len Length of the buffer
+ * @param[out] out Parsed dates
+ * @param[out] invalid Indexes of records that are not valid dates
+ * @return size_t Count of dates appended to out
+ */
+size_t parseDates(const char *buf, size_t len, vector<CDate> &out, vector<size_t> &invalid)
+{
+    size_t oldSize = out.size();
+    size_t pos = 0;
+    out.reserve(oldSize + len / 11 + 1);
+
+    for (size_t index = 0; pos < len; index++)
+    {
+        size_t end = pos + 10;
+        bool valid = false;
+        CDate date;
+
+        if (len - pos >= 10)
+        {
+            valid = CDate::parseIso(buf + pos, date.m_days);
+
+            if (end < len && buf[end] == '\r')
+                end++;
+            valid &= end == len || buf[end] == '\n' || buf[end] == ',';
+        }
+
+        if (valid)
+            out.push_back(date);
+        else
+        {
+            invalid.push_back(index);
+            for (end = pos; end < len && buf[end] != '\n' && buf[end] != ','; end++)
+                ;
+        }
+
+        // Skip the separator
+        pos = end + 1;
+    }
+
+    return out.size() - oldSize;
+}
+
+/**
+ * @brief Write date in YYYY-MM-DD format, without any streams, like to_chars() no terminating zero is written
+ *
+ * @param[out] out Buffer for at least CDate::MAX_FORMATTED_LENGTH characters (10 for years 0-9999)
+ * @param[in] date
+ * @return char* Pointer past the last written character
+ */
+char *formatDate(char *out, const CDate &date)
+{
+    int year, month, day;
+    CDate::civilFromDays(date.m_days, year, month, day);
+
+    out = writePadded(out, year, 4);
+    *out++ = '-';
+    out = writePadded(out, month, 2);
+    *out++ = '-';
+    return writePadded(out, day, 2);
+}
+
+/**
+ * @brief Write dates in YYYY-MM-DD format, each followed by newline, so the output can be read by parseDates()
+ *
+ * @param[in] dates
+ * @param[in] count Count of dates
+ * @param[out] out Buffer for at least count * (CDate::MAX_FORMATTED_LENGTH + 1) characters (11 per date for years 0-9999)
+ * @return char* Pointer past the last written character
+ */
+char *formatDates(const CDate *dates, size_t count, char *out)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        out = formatDate(out, dates[i]);
+        *out++ = '\n';
+    }
+
+    return out;
+}
+//=================================================================================================
+// Calendar of business days, given by weekend days and holidays. Business days are counted by whole
+// weeks in O(1) and holidays by binary search in the sorted list, no day is visited one by one.
+class CBusinessCalendar
+{
+public:
+    // Bits of the weekend mask
+    enum EWeekday
+    {
+        MONDAY = 1,
+        TUESDAY = 2,
+        WEDNESDAY = 4,
+        THURSDAY = 8,
+        FRIDAY = 16,
+        SATURDAY = 32,
+        SUNDAY = 64
+    };
+
+private:
+    // Day numbers of holidays that are not on weekend, sorted
+    vector<int32_t> m_holidays;
+    uint8_t m_weekendMask;
+    int m_businessDaysInWeek = 0;
+    // Business days among the first n days (index 2) of week starting on weekday (index 1, 0 is Monday)
+    int m_businessDaysInPart[7][7] = {};
+
+    // Weekday of day number, 0 is Monday
+    static int weekday(int32_t days)
     {
-        return abs(countDaysDifference(*this, rhs));
+        return CDate::fromDayNumber(days).dayOfWeek() - 1;
+    }
+
+    // Business days in [from, to) without holidays, from <= to
+    int weekdaysBetween(int32_t from, int32_t to) const
+    {
+        int64_t days = (int64_t)to - from;
+        return (int)(days / 7 * m_businessDaysInWeek + m_businessDaysInPart[weekday(from)][days % 7]);
+    }
+
+    // Holidays in [from, to), from <= to
+    int holidaysBetween(int32_t from, int32_t to) const
+    {
+        return (int)(lower_bound(m_holidays.begin(), m_holidays.end(), to) -
+                     lower_bound(m_holidays.begin(), m_holidays.end(), from));
+    }
+
+    int countBetween(int32_t from, int32_t to) const
+    {
+        return weekdaysBetween(from, to) - holidaysBetween(from, to);
+    }
+
+public:
+    /**
+     * @brief Create calendar with given weekend days and holidays
+     *
+     * @param[in] weekendMask Weekend days joined by |, e.g. SATURDAY | SUNDAY
+     * @param[in] holidays Holidays in any order, may repeat or fall on weekend
+     * @throw invalid_argument If there are no business days in week
+     */
+    CBusinessCalendar(uint8_t weekendMask, const vector<CDate> &holidays)
+        : m_weekendMask(weekendMask)
+    {
+        for (int day = 0; day < 7; day++)
+            m_businessDaysInWeek += !(m_weekendMask & (1 << day));
+
+        if (m_businessDaysInWeek == 0)
+            throw invalid_argument("no business days in week");
+
+        for (int start = 0; start < 7; start++)
+            for (int length = 1; length < 7; length++)
+                m_businessDaysInPart[start][length] = m_businessDaysInPart[start][length - 1] +
+                                                      !(m_weekendMask & (1 << ((start + length - 1) % 7)));
+
+        for (const CDate &holiday : holidays)
+            if (!(m_weekendMask & (1 << weekday(holiday.dayNumber()))))
+                m_holidays.push_back(holiday.dayNumber());
+
+        sort(m_holidays.begin(), m_holidays.end());
+        m_holidays.erase(unique(m_holidays.begin(), m_holidays.end()), m_holidays.end());
+    }
+
+    bool isBusinessDay(const CDate &date) const
+    {
+        int32_t days = date.dayNumber();
+        return !(m_weekendMask & (1 << weekday(days))) && !binary_search(m_holidays.begin(), m_holidays.end(), days);
+    }
+
+    /**
+     * @brief Count business days from a (inclusive) to b (exclusive), in O(log h) for h holidays
+     *
+     * @return int Count of business days, negative if b is before a
+     */
+    int businessDaysBetween(const CDate &a, const CDate &b) const
+    {
+        if (b < a)
+            return -countBetween(b.dayNumber(), a.dayNumber());
+
+        return countBetween(a.dayNumber(), b.dayNumber());
+    }
+
+    /**
+     * @brief Move date by n business days, in O(log n * log h) by binary search over the result
+     *
+     * Positive n gives n-th business day after date, negative n gives (-n)-th business day before it,
+     * zero gives date itself if it's a business day and the next business day otherwise.
+     */
+    CDate addBusinessDays(const CDate &date, int n) const
+    {
+        int32_t days = date.dayNumber();
+        int64_t needed = n == 0 ? 1 : (n > 0 ? n : -(int64_t)n);
+        // There are at most all the holidays and full weeks for the needed days before the result
+        int64_t range = ((needed + (int64_t)m_holidays.size()) / m_businessDaysInWeek + 1) * 7;
+
+        if (n >= 0)
+        {
+            // Smallest day, such that there is enough business days from the start up to it
+            int32_t from = days + (n > 0);
+            int64_t low = from, high = from + range;
+            while (low < high)
+            {
+                int64_t middle = low + (high - low) / 2;
+                if (countBetween(from, (int32_t)middle + 1) >= needed)
+                    high = middle;
+                else
+                    low = middle + 1;
+            }
+            return CDate::fromDayNumber((int32_t)low);
+        }
+
+        // Largest day, such that there is enough business days from it up to the date
+        int64_t low = days - range, high = days - 1;
+        while (low < high)
+        {
+            int64_t middle = low + (high - low + 1) / 2;
+            if (countBetween((int32_t)middle, days) >= needed)
+                low = middle;
+            else
+                high = middle - 1;
+        }
+        return CDate::fromDayNumber((int32_t)low);
+    }
+};
+//=================================================================================================
+// Set of dates stored as disjoint intervals ordered by start, overlapping or adjacent intervals are
+// joined on insert, so every date is in at most one interval and lookups are O(log n).
+class CDateIntervalSet
+{
+private:
+    // Start day number -> day number after the end, intervals are disjoint and never adjacent
+    map<int32_t, int32_t> m_intervals;
+    int64_t m_coveredDays = 0;
+
+    // First interval that ends after the day (it contains the day or starts after it)
+    map<int32_t, int32_t>::const_iterator findEndingAfter(int32_t day) const
+    {
+        auto iter = m_intervals.upper_bound(day);
+        if (iter != m_intervals.begin() && prev(iter)->second > day)
+            --iter;
+        return iter;
+    }
+
+public:
+    /**
+     * @brief Add all dates from one date to other (both inclusive), joining with overlapping and adjacent intervals
+     *
+     * @param[in] from First date
+     * @param[in] to Last date, nothing is added if it's before from
+     */
+    void insert(const CDate &from, const CDate &to)
+    {
+        if (to < from)
+            return;
+
+        int32_t start = from.dayNumber();
+        int32_t end = to.dayNumber() + 1;
+
+        // Interval ending right before start is joined too
+        auto iter = m_intervals.upper_bound(start);
+        if (iter != m_intervals.begin() && prev(iter)->second >= start)
+            --iter;
+
+        while (iter != m_intervals.end() && iter->first <= end)
+        {
+            start = min(start, iter->first);
+            end = max(end, iter->second);
+            m_coveredDays -= iter->second - iter->first;
+            iter = m_intervals.erase(iter);
+        }
+
+        m_intervals.emplace_hint(iter, start, end);
+        m_coveredDays += end - start;
+    }
+
+    /**
+     * @brief Remove all dates from one date to other (both inclusive), intervals are cut or split
+     *
+     * @param[in] from First date
+     * @param[in] to Last date, nothing is removed if it's before from
+     */
+    void erase(const CDate &from, const CDate &to)
+    {
+        if (to < from)
+            return;
+
+        int32_t start = from.dayNumber();
+        int32_t end = to.dayNumber() + 1;
+
+        auto iter = findEndingAfter(start);
+        while (iter != m_intervals.end() && iter->first < end)
+        {
+            int32_t intervalStart = iter->first;
+            int32_t intervalEnd = iter->second;
+
+            m_coveredDays -= intervalEnd - intervalStart;
+            iter = m_intervals.erase(iter);
+
+            // Keep parts of the interval out of the removed range
+            if (intervalStart < start)
+            {
+                m_intervals.emplace_hint(iter, intervalStart, start);
+                m_coveredDays += start - intervalStart;
+            }
+            if (intervalEnd > end)
+            {
+                m_intervals.emplace_hint(iter, end, intervalEnd);
+                m_coveredDays += intervalEnd - end;
+            }
+        }
+    }
+
+    bool covers(const CDate &date) const
+    {
+        auto iter = findEndingAfter(date.dayNumber());
+        return iter != m_intervals.end() && iter->first <= date.dayNumber();
+    }
+
+    /**
+     * @brief Get intervals with at least one date from one date to other (both inclusive), in O(log n + k)
+     *
+     * @return vector<pair<CDate, CDate>> First and last dates (inclusive) of the intervals, in order
+     */
+    vector<pair<CDate, CDate>> overlapping(const CDate &from, const CDate &to) const
+    {
+        vector<pair<CDate, CDate>> result;
+
+        for (auto iter = findEndingAfter(from.dayNumber());
+             iter != m_intervals.end() && iter->first <= to.dayNumber(); ++iter)
+            result.emplace_back(CDate::fromDayNumber(iter->first), CDate::fromDayNumber(iter->second - 1));
+
+        return result;
+    }
+
+    // Count of days in all intervals, kept up to date by insert and erase
+    int64_t totalCoveredDays() const
+    {
+        return m_coveredDays;
+    }
+
+    // Count of disjoint intervals
+    size_t size() const
+    {
+        return m_intervals.size();
     }
 };
 
@@ -520,134 +1324,318 @@ int main(void)
     oss.str("");
     oss << d;
     assert(oss.str() == "2000-02-29");
-    /*
-                //-----------------------------------------------------------------------------
-                // bonus test examples
-                //-----------------------------------------------------------------------------
-                CDate f(2000, 5, 12);
-                oss.str("");
-                oss << f;
-                assert(oss.str() == "2000-05-12");
-                oss.str("");
-                oss << date_format("%Y/%m/%d") << f;
-                assert(oss.str() == "2000/05/12");
-                oss.str("");
-                oss << date_format("%d.%m.%Y") << f;
-                assert(oss.str() == "12.05.2000");
-                oss.str("");
-                oss << date_format("%m/%d/%Y") << f;
-                assert(oss.str() == "05/12/2000");
-                oss.str("");
-                oss << date_format("%Y%m%d") << f;
-                assert(oss.str() == "20000512");
-                oss.str("");
-                oss << date_format("hello kitty") << f;
-                assert(oss.str() == "hello kitty");
-                oss.str("");
-                oss << date_format("%d%d%d%d%d%d%m%m%m%Y%Y%Y%%%%%%%%%%") << f;
-                assert(oss.str() == "121212121212050505200020002000%%%%%");
-                oss.str("");
-                oss << date_format("%Y-%m-%d") << f;
-                assert(oss.str() == "2000-05-12");
-                iss.clear();
-                iss.str("2001-01-1");
-                assert(!(iss >> f));
-                oss.str("");
-                oss << f;
-                assert(oss.str() == "2000-05-12");
-                iss.clear();
-                iss.str("2001-1-01");
-                assert(!(iss >> f));
-                oss.str("");
-                oss << f;
-                assert(oss.str() == "2000-05-12");
-                iss.clear();
-                iss.str("2001-001-01");
-                assert(!(iss >> f));
-                oss.str("");
-                oss << f;
-                assert(oss.str() == "2000-05-12");
-                iss.clear();
-                iss.str("2001-01-02");
-                assert((iss >> date_format("%Y-%m-%d") >> f));
-                oss.str("");
-                oss << f;
-                assert(oss.str() == "2001-01-02");
-                iss.clear();
-                iss.str("05.06.2003");
-                assert((iss >> date_format("%d.%m.%Y") >> f));
-                oss.str("");
-                oss << f;
-                assert(oss.str() == "2003-06-05");
-                iss.clear();
-                iss.str("07/08/2004");
-                assert((iss >> date_format("%m/%d/%Y") >> f));
-                oss.str("");
-                oss << f;
-                assert(oss.str() == "2004-07-08");
-                iss.clear();
-                iss.str("2002*03*04");
-                assert((iss >> date_format("%Y*%m*%d") >> f));
-                oss.str("");
-                oss << f;
-                assert(oss.str() == "2002-03-04");
-                iss.clear();
-                iss.str("C++09format10PA22006rulez");
-                assert((iss >> date_format("C++%mformat%dPA2%Yrulez") >> f));
-                oss.str("");
-                oss << f;
-                assert(oss.str() == "2006-09-10");
-                iss.clear();
-                iss.str("%12%13%2010%");
-                assert((iss >> date_format("%%%m%%%d%%%Y%%") >> f));
-                oss.str("");
-                oss << f;
-                assert(oss.str() == "2010-12-13");
-
-                CDate g(2000, 6, 8);
-                iss.clear();
-                iss.str("2001-11-33");
-                assert(!(iss >> date_format("%Y-%m-%d") >> g));
-                oss.str("");
-                oss << g;
-                assert(oss.str() == "2000-06-08");
-                iss.clear();
-                iss.str("29.02.2003");
-                assert(!(iss >> date_format("%d.%m.%Y") >> g));
-                oss.str("");
-                oss << g;
-                assert(oss.str() == "2000-06-08");
-                iss.clear();
-                iss.str("14/02/2004");
-                assert(!(iss >> date_format("%m/%d/%Y") >> g));
-                oss.str("");
-                oss << g;
-                assert(oss.str() == "2000-06-08");
-                iss.clear();
-                iss.str("2002-03");
-                assert(!(iss >> date_format("%Y-%m") >> g));
-                oss.str("");
-                oss << g;
-                assert(oss.str() == "2000-06-08");
-                iss.clear();
-                iss.str("hello kitty");
-                assert(!(iss >> date_format("hello kitty") >> g));
-                oss.str("");
-                oss << g;
-                assert(oss.str() == "2000-06-08");
-                iss.clear();
-                iss.str("2005-07-12-07");
-                assert(!(iss >> date_format("%Y-%m-%d-%m") >> g));
-                oss.str("");
-                oss << g;
-                assert(oss.str() == "2000-06-08");
-                iss.clear();
-                iss.str("20000101");
-                assert((iss >> date_format("%Y%m%d") >> g));
-                oss.str("");
-                oss << g;
-                assert(oss.str() == "2000-01-01");
-            */
+
+    try
+    {
+        CDate zero(2000, 1, 0);
+        assert("No exception thrown!" == nullptr);
+    }
+    catch (const InvalidDateException &)
+    {
+    }
+
+    // Year 4000 is not leap
+    oss.str("");
+    oss << CDate(4000, 2, 28) + 1 << " " << CDate(2000, 2, 28) + 1;
+    assert(oss.str() == "4000-03-01 2000-02-29");
+    assert(CDate(9999, 12, 31) - CDate(1, 1, 1) == 3652056);
+    assert(CDate(1970, 1, 1) - CDate(1969, 12, 31) == 1);
+
+    CDate clamped(2000, 1, 31);
+    clamped.addMonths(1);
+    assert(clamped == CDate(2000, 2, 29));
+    clamped.addYears(1);
+    assert(clamped == CDate(2001, 2, 28));
+    clamped.addMonths(-14);
+    assert(clamped == CDate(1999, 12, 28));
+
+    // Walk day by day over several eras, including negative years
+    CDate walk(-4000, 1, 1);
+    int walkYear = -4000, walkMonth = 1, walkDay = 1;
+    while (walkYear < 8001)
+    {
+        assert(walk.year() == walkYear && walk.month() == walkMonth && walk.day() == walkDay);
+        assert(walk == CDate(walkYear, walkMonth, walkDay));
+
+        ++walk;
+        if (++walkDay > CDate::getDaysInMonth(walkYear, walkMonth))
+        {
+            walkDay = 1;
+            if (++walkMonth > 12)
+            {
+                walkMonth = 1;
+                walkYear++;
+            }
+        }
+    }
+    //-----------------------------------------------------------------------------
+    // bonus test examples
+    //-----------------------------------------------------------------------------
+    CDate f(2000, 5, 12);
+    oss.str("");
+    oss << f;
+    assert(oss.str() == "2000-05-12");
+    oss.str("");
+    oss << date_format("%Y/%m/%d") << f;
+    assert(oss.str() == "2000/05/12");
+    oss.str("");
+    oss << date_format("%d.%m.%Y") << f;
+    assert(oss.str() == "12.05.2000");
+    oss.str("");
+    oss << date_format("%m/%d/%Y") << f;
+    assert(oss.str() == "05/12/2000");
+    oss.str("");
+    oss << date_format("%Y%m%d") << f;
+    assert(oss.str() == "20000512");
+    oss.str("");
+    oss << date_format("hello kitty") << f;
+    assert(oss.str() == "hello kitty");
+    oss.str("");
+    oss << date_format("%d%d%d%d%d%d%m%m%m%Y%Y%Y%%%%%%%%%%") << f;
+    assert(oss.str() == "121212121212050505200020002000%%%%%");
+    oss.str("");
+    oss << date_format("%Y-%m-%d") << f;
+    assert(oss.str() == "2000-05-12");
+    iss.clear();
+    iss.str("2001-01-1");
+    assert(!(iss >> f));
+    oss.str("");
+    oss << f;
+    assert(oss.str() == "2000-05-12");
+    iss.clear();
+    iss.str("2001-1-01");
+    assert(!(iss >> f));
+    oss.str("");
+    oss << f;
+    assert(oss.str() == "2000-05-12");
+    iss.clear();
+    iss.str("2001-001-01");
+    assert(!(iss >> f));
+    oss.str("");
+    oss << f;
+    assert(oss.str() == "2000-05-12");
+    iss.clear();
+    iss.str("2001-01-02");
+    assert((iss >> date_format("%Y-%m-%d") >> f));
+    oss.str("");
+    oss << f;
+    assert(oss.str() == "2001-01-02");
+    iss.clear();
+    iss.str("05.06.2003");
+    assert((iss >> date_format("%d.%m.%Y") >> f));
+    oss.str("");
+    oss << f;
+    assert(oss.str() == "2003-06-05");
+    iss.clear();
+    iss.str("07/08/2004");
+    assert((iss >> date_format("%m/%d/%Y") >> f));
+    oss.str("");
+    oss << f;
+    assert(oss.str() == "2004-07-08");
+    iss.clear();
+    iss.str("2002*03*04");
+    assert((iss >> date_format("%Y*%m*%d") >> f));
+    oss.str("");
+    oss << f;
+    assert(oss.str() == "2002-03-04");
+    iss.clear();
+    iss.str("C++09format10PA22006rulez");
+    assert((iss >> date_format("C++%mformat%dPA2%Yrulez") >> f));
+    oss.str("");
+    oss << f;
+    assert(oss.str() == "2006-09-10");
+    iss.clear();
+    iss.str("%12%13%2010%");
+    assert((iss >> date_format("%%%m%%%d%%%Y%%") >> f));
+    oss.str("");
+    oss << f;
+    assert(oss.str() == "2010-12-13");
+
+    CDate g(2000, 6, 8);
+    iss.clear();
+    iss.str("2001-11-33");
+    assert(!(iss >> date_format("%Y-%m-%d") >> g));
+    oss.str("");
+    oss << g;
+    assert(oss.str() == "2000-06-08");
+    iss.clear();
+    iss.str("29.02.2003");
+    assert(!(iss >> date_format("%d.%m.%Y") >> g));
+    oss.str("");
+    oss << g;
+    assert(oss.str() == "2000-06-08");
+    iss.clear();
+    iss.str("14/02/2004");
+    assert(!(iss >> date_format("%m/%d/%Y") >> g));
+    oss.str("");
+    oss << g;
+    assert(oss.str() == "2000-06-08");
+    iss.clear();
+    iss.str("2002-03");
+    assert(!(iss >> date_format("%Y-%m") >> g));
+    oss.str("");
+    oss << g;
+    assert(oss.str() == "2000-06-08");
+    iss.clear();
+    iss.str("hello kitty");
+    assert(!(iss >> date_format("hello kitty") >> g));
+    oss.str("");
+    oss << g;
+    assert(oss.str() == "2000-06-08");
+    iss.clear();
+    iss.str("2005-07-12-07");
+    assert(!(iss >> date_format("%Y-%m-%d-%m") >> g));
+    oss.str("");
+    oss << g;
+    assert(oss.str() == "2000-06-08");
+    iss.clear();
+    iss.str("20000101");
+    assert((iss >> date_format("%Y%m%d") >> g));
+    oss.str("");
+    oss << g;
+    assert(oss.str() == "2000-01-01");
+
+    // Format is owned by each stream, copyfmt() makes an independent copy
+    oss << date_format("%d.%m.%Y");
+    ostringstream copied;
+    copied.copyfmt(oss);
+    oss << date_format("%Y/%m/%d");
+    copied << CDate(2000, 5, 12);
+    assert(copied.str() == "12.05.2000");
+
+    const char csv[] = "2000-01-01\n2000-02-30,1999-12-31\r\nbad\n2000-13-01\n\n4000-02-29,2004-02-29\n";
+    vector<CDate> parsed;
+    vector<size_t> invalid;
+    assert(parseDates(csv, sizeof(csv) - 1, parsed, invalid) == 3);
+    assert(parsed.size() == 3 && parsed[0] == CDate(2000, 1, 1) && parsed[1] == CDate(1999, 12, 31) &&
+           parsed[2] == CDate(2004, 2, 29));
+    assert((invalid == vector<size_t>{1, 3, 4, 5, 6}));
+    assert(parseDates("2000-01-0", 9, parsed, invalid) == 0 && invalid.back() == 0);
+    assert(parseDates("2000/01/01", 10, parsed, invalid) == 0 && parsed.size() == 3);
+
+    char formatted[3 * (CDate::MAX_FORMATTED_LENGTH + 1)];
+    *formatDate(formatted, CDate(2000, 5, 12)) = '\0';
+    assert(string(formatted) == "2000-05-12");
+    *formatDate(formatted, CDate(12345, 1, 2)) = '\0';
+    assert(string(formatted) == "12345-01-02");
+    char *formattedEnd = formatDates(parsed.data(), parsed.size(), formatted);
+    assert(string(formatted, formattedEnd) == "2000-01-01\n1999-12-31\n2004-02-29\n");
+    vector<CDate> reparsed;
+    assert(parseDates(formatted, formattedEnd - formatted, reparsed, invalid) == 3 && reparsed == parsed);
+
+    assert(CDate::fromDayNumber(CDate(2000, 1, 1).dayNumber()) == CDate(2000, 1, 1));
+    assert(CDate(1970, 1, 2).dayNumber() == 1 && CDate(1969, 12, 31).dayNumber() == -1);
+    vector<int32_t> columnA, columnB, differences(100);
+    for (int i = 0; i < 100; i++)
+    {
+        columnA.push_back((CDate(2000, 1, 1) + i * 3).dayNumber());
+        columnB.push_back((CDate(2000, 1, 1) + i).dayNumber());
+    }
+    diffDays(columnA.data(), columnB.data(), columnA.size(), differences.data());
+    assert(differences[0] == 0 && differences[99] == 198);
+    uint64_t bitmap[2];
+    assert(filterRange(columnB.data(), columnB.size(), CDate(2000, 1, 2).dayNumber(), CDate(2000, 3, 5).dayNumber(), bitmap) == 64);
+    assert(bitmap[0] == ~1ull && bitmap[1] == 1);
+    assert(filterRange(columnB.data(), columnB.size(), CDate(2000, 3, 5).dayNumber(), CDate(2000, 1, 2).dayNumber(), bitmap) == 0);
+    assert(bitmap[0] == 0 && bitmap[1] == 0);
+    assert(filterRange(columnB.data(), columnB.size(), INT32_MIN, INT32_MAX, bitmap) == 100);
+    assert(bitmap[0] == ~0ull && bitmap[1] == (1ull << 36) - 1);
+
+    CBusinessCalendar business(CBusinessCalendar::SATURDAY | CBusinessCalendar::SUNDAY,
+                               {CDate(2025, 1, 1), CDate(2024, 12, 26), CDate(2024, 12, 24), CDate(2024, 12, 25),
+                                CDate(2024, 12, 28), CDate(2024, 12, 25)});
+    assert(business.businessDaysBetween(CDate(2024, 12, 23), CDate(2024, 12, 30)) == 2);
+    assert(business.businessDaysBetween(CDate(2024, 12, 30), CDate(2024, 12, 23)) == -2);
+    assert(business.addBusinessDays(CDate(2024, 12, 23), 1) == CDate(2024, 12, 27));
+    assert(business.addBusinessDays(CDate(2024, 12, 31), 1) == CDate(2025, 1, 2));
+    assert(business.addBusinessDays(CDate(2024, 12, 28), 0) == CDate(2024, 12, 30));
+    assert(business.addBusinessDays(CDate(2024, 12, 30), 0) == CDate(2024, 12, 30));
+    assert(business.addBusinessDays(CDate(2024, 12, 27), -1) == CDate(2024, 12, 23));
+    assert(!business.isBusinessDay(CDate(2024, 12, 25)) && business.isBusinessDay(CDate(2024, 12, 27)));
+
+    // Compare with walking day by day
+    for (int n = -300; n <= 300; n++)
+    {
+        CDate start(2024, 12, 20 + n % 10 + (n < 0 ? 10 : 0)), expected = start;
+        for (int remaining = n; remaining > 0;)
+            remaining -= business.isBusinessDay(++expected);
+        for (int remaining = n; remaining < 0;)
+            remaining += business.isBusinessDay(--expected);
+        while (n == 0 && !business.isBusinessDay(expected))
+            ++expected;
+
+        assert(business.addBusinessDays(start, n) == expected);
+        assert(n == 0 || business.businessDaysBetween(start + (n > 0), expected + (n > 0)) == n);
+    }
+
+    unordered_map<CDate, int> byDate;
+    byDate[CDate(2000, 1, 1)] = 1;
+    byDate[CDate(1999, 12, 31) + 1]++;
+    byDate[CDate(2000, 1, 2)] = 5;
+    assert(byDate.size() == 2 && byDate[CDate(2000, 1, 1)] == 2);
+#if defined(__cpp_lib_three_way_comparison) && __cpp_lib_three_way_comparison >= 201907L
+    assert((CDate(2000, 1, 1) <=> CDate(2000, 1, 2)) < 0);
+#endif
+
+    assert(CDate::tryMake(2000, 2, 29) == CDate(2000, 2, 29));
+    assert(!CDate::tryMake(2001, 2, 29) && !CDate::tryMake(2000, 13, 1) && !CDate::tryMake(2000, 1, 0));
+    static_assert(CDate::tryMake(2024, 2, 29).has_value() && !CDate::tryMake(4000, 2, 29).has_value(),
+                  "tryMake can be evaluated at compile time");
+
+    // Day numbers of the first and the last valid date fit to int32, years out of the range are not valid
+    CDate last = *CDate::tryMake(CDate::MAX_YEAR, 12, 31);
+    CDate first = *CDate::tryMake(CDate::MIN_YEAR, 1, 1);
+    assert(last.year() == CDate::MAX_YEAR && last.month() == 12 && last.day() == 31 && last.dayOfYear() == 365);
+    assert(first.year() == CDate::MIN_YEAR && first.month() == 1 && first.day() == 1 && first.isoWeek() >= 1);
+    assert(last - first == CDate::countDaysDifference(first, last) && last - first > 1460000000 && last.isoWeek() >= 1);
+    assert(!CDate::tryMake(CDate::MAX_YEAR + 1, 1, 1) && !CDate::tryMake(CDate::MIN_YEAR - 1, 12, 31));
+    assert(!CDate::tryMake(INT_MAX, 1, 1) && !CDate::tryMake(INT_MIN, 12, 31));
+    for (int year : {CDate::MAX_YEAR + 1, CDate::MIN_YEAR - 1, (int)INT_MAX, (int)INT_MIN})
+    {
+        bool thrown = false;
+        try
+        {
+            CDate outOfRange(year, 1, 1);
+        }
+        catch (const InvalidDateException &)
+        {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+    bool yearsThrown = false;
+    try
+    {
+        last.addYears(INT_MAX);
+    }
+    catch (const InvalidDateException &)
+    {
+        yearsThrown = true;
+    }
+    assert(yearsThrown && last == *CDate::tryMake(CDate::MAX_YEAR, 12, 31));
+
+    CDateIntervalSet periods;
+    periods.insert(CDate(2024, 1, 1), CDate(2024, 1, 31));
+    periods.insert(CDate(2024, 3, 1), CDate(2024, 3, 31));
+    periods.insert(CDate(2024, 2, 1), CDate(2024, 2, 10));
+    periods.insert(CDate(2024, 5, 1), CDate(2024, 4, 1));
+    assert(periods.size() == 2 && periods.totalCoveredDays() == 31 + 10 + 31);
+    assert(periods.covers(CDate(2024, 2, 10)) && !periods.covers(CDate(2024, 2, 11)) && !periods.covers(CDate(2023, 12, 31)));
+    periods.insert(CDate(2024, 2, 5), CDate(2024, 3, 5));
+    assert(periods.size() == 1 && periods.totalCoveredDays() == 31 + 29 + 31);
+    periods.erase(CDate(2024, 2, 1), CDate(2024, 2, 29));
+    periods.erase(CDate(2024, 3, 31), CDate(2024, 4, 30));
+    assert(periods.size() == 2 && periods.totalCoveredDays() == 31 + 30);
+    auto overlapping = periods.overlapping(CDate(2024, 1, 31), CDate(2024, 3, 1));
+    assert(overlapping.size() == 2 && overlapping[0].first == CDate(2024, 1, 1) && overlapping[0].second == CDate(2024, 1, 31) &&
+           overlapping[1].first == CDate(2024, 3, 1) && overlapping[1].second == CDate(2024, 3, 30));
+    assert(periods.overlapping(CDate(2024, 2, 1), CDate(2024, 2, 29)).empty());
+    periods.erase(CDate(2024, 1, 10), CDate(2024, 1, 19));
+    assert(periods.size() == 3 && periods.totalCoveredDays() == 21 + 30 && !periods.covers(CDate(2024, 1, 15)));
+
+    CDate fields(2024, 8, 15);
+    assert(fields.dayOfWeek() == 4 && fields.dayOfYear() == 228 && fields.quarter() == 3 && fields.isoWeek() == 33);
+    assert(CDate(2026, 1, 1).isoWeek() == 1 && CDate(2027, 1, 1).isoWeek() == 53 && CDate(2024, 3, 31).quarter() == 1);
     return EXIT_SUCCESS;
 }
 #endif /* __PROGTEST__ */
\ No newline at end of file